@@ -46,6 +46,10 @@ SPINLOCK_INLINE
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+bool spinlock_data_compareandswap(volatile spinlock_data_t *sd,
+				  spinlock_data_t oldval,
+				  spinlock_data_t newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -118,5 +122,48 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+/*
+ * Compare-and-swap a spinlock_data_t. If *SD contains OLDVAL, replace
+ * it with NEWVAL and return true; otherwise leave it alone and return
+ * false. Also returns false if the SC fails, so callers should reread
+ * and retry in a loop.
+ *
+ * This is not used by the spinlock code itself; it is here so that
+ * lock-free structures elsewhere in the kernel can use the same LL/SC
+ * machinery. The comparison is done with a branch between the LL and
+ * the SC, which is allowed because it does not touch memory.
+ */
+SPINLOCK_INLINE
+bool
+spinlock_data_compareandswap(volatile spinlock_data_t *sd,
+			     spinlock_data_t oldval, spinlock_data_t newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Load the existing value into X. If it does not match,
+	 * skip the SC with Y = 0 (set in the branch delay slot).
+	 * Otherwise SC NEWVAL; afterwards Y is 1 if the store
+	 * succeeded and 0 if it failed.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slot ourselves */
+		"ll %0, 0(%2);"		/*   x = *sd */
+		"bne %0, %3, 1f;"	/*   if (x != oldval) goto 1 */
+		" move %1, $0;"		/*   y = 0 (delay slot) */
+		"move %1, %4;"		/*   y = newval */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"1:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (sd), "r" (oldval), "r" (newval)
+		: "memory");
+	return y != 0;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -116,11 +116,12 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_vaddr;		/* page to invalidate */
+	bool ts_flushall;		/* or, flush the whole TLB */
+	struct semaphore *ts_done;	/* if not NULL, V'd when done */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -27,17 +27,24 @@
  * SUCH DAMAGE.
  */
 
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <spl.h>
 #include <cpu.h>
 #include <spinlock.h>
+#include <membar.h>
+#include <synch.h>
+#include <clock.h>
+#include <thread.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <swap.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -60,14 +67,167 @@
 #define DUMBVM_STACKPAGES    18
 
 /*
- * Wrap ram_stealmem in a spinlock.
+ * Each address space has a two-level page table. The top ten bits of
+ * a user address index the page directory, as_ptdir, whose entries
+ * point to page-sized tables of ptes indexed by the next ten bits.
+ * Second-level tables are only allocated for the parts of the
+ * address space that are actually mapped.
+ *
+ * Nothing is mapped up front. as_define_region only records the
+ * regions, and the first touch of each page faults it in, zero-filled.
+ * (The ELF loader's writes fault in the pages that hold file data;
+ * BSS and stack pages that are never touched are never allocated.)
+ *
+ * as_copy shares the parent's pages with the child copy-on-write
+ * instead of copying them. Both ptes lose TLBLO_DIRTY, and the page's
+ * coremap reference count goes up. A write to such a page then takes
+ * a VM_FAULT_READONLY fault, which copies the page if it's still
+ * shared, or just makes it writable again if it isn't. Since all
+ * regions are read-write in dumbvm, a valid pte without TLBLO_DIRTY
+ * always means a copy-on-write page.
+ *
+ * A pte is kept in exactly the form the TLB wants for ENTRYLO: the
+ * physical page number plus TLBLO_VALID and TLBLO_DIRTY. A TLB miss
+ * is then two loads and a tlb_random.
+ *
+ * When memory runs short, pages are written out to swap. The pte of
+ * a page in swap holds its swap slot where the page number would go,
+ * and PTE_SWAPPED instead of TLBLO_VALID. A pageout thread, woken
+ * when free frames drop below VM_FREELOW, evicts pages chosen by the
+ * coremap's clock until VM_FREEHIGH are free, so faulting threads
+ * normally find a free frame without waiting for a write. While a
+ * page is on its way to or from swap its pte also has PTE_BUSY set,
+ * and anyone else who needs it waits on vm_transitcv.
+ *
+ * Locking: vm_lock covers all changes to page tables and to page
+ * ownership in the coremap; it is dropped during swap I/O, with the
+ * pte marked busy. The TLB refill path only reads ptes and takes no
+ * lock. That is safe because pageout clears the pte and shoots down
+ * the TLB entry everywhere before it writes the page out. vm_lock
+ * comes before the coremap and swap spinlocks.
+ *
+ * TLB shootdowns are batched. Pages to invalidate are collected in a
+ * struct vm_shootbatch, up to TLBSHOOTDOWN_MAX of them (past that the
+ * batch just flushes whole TLBs), and sent with one IPI to each other
+ * cpu whose TLB may hold entries of one of their address spaces.
+ * That is whichever address space the cpu last activated: the TLB is
+ * flushed whenever a different one is activated, but not when a
+ * kernel-only thread runs, so the entries stay until then. Holding
+ * vm_lock makes the sender the only one with a batch in flight, so
+ * target queues never overflow.
+ *
+ * Idle cpus zero pages ahead of time, into a pool of up to
+ * VM_ZEROPOOL_MAX frames, so zero-fill faults and page-table pages
+ * don't have to wait for bzero. The pool only takes memory that isn't
+ * needed: it's only filled while more than VM_FREEHIGH frames are
+ * free, and the allocators fall back on it when the coremap is empty.
  */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+#define PT_NENTRIES    (PAGE_SIZE / sizeof(uint32_t))
+#define PT_NDIRS       (USERSPACETOP >> 22)
+#define PT_DIRINDEX(va)  ((va) >> 22)
+#define PT_INDEX(va)     (((va) >> 12) & (PT_NENTRIES - 1))
+
+#define PTE_SWAPPED    0x00000001	/* not valid; the page is in swap */
+#define PTE_BUSY       0x00000002	/* page going to or from swap */
+#define PTE_SLOT(pte)  ((pte) >> 12)
+#define SLOT_PTE(slot) (((uint32_t)(slot) << 12) | PTE_SWAPPED)
+
+#define VM_FREELOW	16	/* wake pageout below this many free frames */
+#define VM_FREEHIGH	32	/* and have it free up to this many */
+
+#define VM_ZEROPOOL_MAX	32	/* pre-zeroed pages to keep */
+
+static struct lock *vm_lock;
+static struct cv *vm_transitcv;		/* PTE_BUSY cleared somewhere */
+static struct cv *vm_freecv;		/* pageout finished a pass */
+static struct semaphore *vm_pageout_sem;	/* wakes pageout */
+static struct semaphore *vm_shootdown_sem;	/* shootdown acks */
+
+/*
+ * Per-cpu TLB state: the address space whose entries the TLB may
+ * hold, and the cpu itself for sending it IPIs. Set by as_activate.
+ * (LAMEbus has at most 32 cpus, so VM_MAXCPUS covers them all.)
+ */
+struct vm_cpustate {
+	struct cpu *vc_cpu;
+	struct addrspace *vc_as;
+};
+
+struct vm_shootbatch {
+	struct addrspace *sb_as[TLBSHOOTDOWN_MAX];
+	vaddr_t sb_vaddr[TLBSHOOTDOWN_MAX];
+	unsigned sb_num;
+	unsigned sb_total;		/* pages added, counting overflow */
+	bool sb_overflow;		/* too many; flush everything */
+};
+static unsigned vm_pageout_gen;		/* passes pageout has made */
+static unsigned vm_pageout_freed;	/* pages freed by the last one */
+
+static struct spinlock vm_zeropool_lock = SPINLOCK_INITIALIZER;
+static paddr_t vm_zeropool[VM_ZEROPOOL_MAX];
+static unsigned vm_zeropool_num;
+
+/*
+ * Per-cpu fault counters. Each cpu only touches its own, with
+ * interrupts off, so they need no lock.
+ */
+#define VM_MAXCPUS	32	/* further cpus aren't counted */
+
+struct vm_cpustats {
+	unsigned vs_tlbfaults;		/* TLB refills done */
+	unsigned vs_badfaults;		/* faults on unmapped addresses */
+	unsigned vs_zerofills;		/* pages faulted in zero-filled */
+	unsigned vs_zeropoolhits;	/* ...that were already zeroed */
+	unsigned vs_idlezeroed;		/* pages zeroed by the idle loop */
+	unsigned vs_forks;		/* address spaces copied */
+	unsigned vs_cowshared;		/* pages shared by as_copy */
+	unsigned vs_cowcopies;		/* shared pages copied on write */
+	unsigned vs_pageins;		/* pages read from swap */
+	unsigned vs_pageouts;		/* pages written to swap */
+	unsigned vs_stalls;		/* faults that waited for a frame */
+	unsigned vs_shootbatches;	/* shootdown batches sent */
+	unsigned vs_shootpages;		/* pages shot down in them */
+	unsigned vs_shootflushes;	/* batches that overflowed */
+	unsigned vs_shootipis;		/* IPIs sent for them */
+	uint64_t vs_pageinns;		/* time spent in page-in reads */
+	uint64_t vs_pageoutns;		/* time spent in page-out writes */
+	uint64_t vs_stallns;		/* time faults waited for a frame */
+	int vs_resident;		/* user pages allocated less freed */
+};
+
+static struct vm_cpustats vm_stats[VM_MAXCPUS];
+static struct vm_cpustate vm_cpustate[VM_MAXCPUS];
+static struct timespec vm_statstart;
+
+static void vm_pageout_thread(void *, unsigned long);
 
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	int result;
+
+	coremap_bootstrap();
+	gettime(&vm_statstart);
+
+	vm_lock = lock_create("vm");
+	vm_transitcv = cv_create("vm transit");
+	vm_freecv = cv_create("vm free");
+	vm_pageout_sem = sem_create("pageout", 0);
+	vm_shootdown_sem = sem_create("shootdown", 0);
+	if (vm_lock == NULL || vm_transitcv == NULL || vm_freecv == NULL ||
+	    vm_pageout_sem == NULL || vm_shootdown_sem == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+
+	swap_bootstrap();
+	if (swap_enabled()) {
+		result = thread_fork("pageout", NULL, vm_pageout_thread,
+				     NULL, 0);
+		if (result) {
+			panic("vm_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
 }
 
 /*
@@ -94,14 +254,24 @@ static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
+	return coremap_alloc(npages);
+}
 
-	addr = ram_stealmem(npages);
+/*
+ * Take a pre-zeroed frame from the pool, or return 0 if it's empty.
+ */
+static
+paddr_t
+vm_zeropool_get(void)
+{
+	paddr_t pa = 0;
 
-	spinlock_release(&stealmem_lock);
-	return addr;
+	spinlock_acquire(&vm_zeropool_lock);
+	if (vm_zeropool_num > 0) {
+		pa = vm_zeropool[--vm_zeropool_num];
+	}
+	spinlock_release(&vm_zeropool_lock);
+	return pa;
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -112,7 +282,15 @@ alloc_kpages(unsigned npages)
 
 	dumbvm_can_sleep();
 	pa = getppages(npages);
+	if (pa==0 && npages == 1) {
+		/* The zero pool is free memory too. */
+		pa = vm_zeropool_get();
+	}
 	if (pa==0) {
+		/* Can't wait here; get pageout going for next time. */
+		if (vm_pageout_sem != NULL && swap_enabled()) {
+			V(vm_pageout_sem);
+		}
 		return 0;
 	}
 	return PADDR_TO_KVADDR(pa);
@@ -121,27 +299,801 @@ alloc_kpages(unsigned npages)
 void
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
+	KASSERT(addr >= MIPS_KSEG0);
+	coremap_free(addr - MIPS_KSEG0);
+}
 
-	(void)addr;
+/*
+ * Get the current cpu's counters, or NULL if it doesn't have any.
+ * Call with interrupts off.
+ */
+static
+struct vm_cpustats *
+vm_getstats(void)
+{
+	if (!CURCPU_EXISTS() || curcpu == NULL ||
+	    curcpu->c_number >= VM_MAXCPUS) {
+		return NULL;
+	}
+	return &vm_stats[curcpu->c_number];
+}
+
+/*
+ * Add N to counter FIELD of the current cpu.
+ */
+#define VM_COUNT(field, n) do {					\
+		int vmc_spl = splhigh();				\
+		struct vm_cpustats *vmc_vs = vm_getstats();		\
+		if (vmc_vs != NULL) {					\
+			vmc_vs->field += (n);				\
+		}							\
+		splx(vmc_spl);						\
+	} while (0)
+
+/*
+ * Nanoseconds from START until now.
+ */
+static
+uint64_t
+vm_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	gettime(&now);
+	timespec_sub(&now, start, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Print a count of events and the average time they took.
+ */
+static
+void
+vm_printtimes(const char *what, uint64_t count, uint64_t ns)
+{
+	kprintf("%llu %s", (unsigned long long)count, what);
+	if (count > 0) {
+		kprintf(" (%llu us each)",
+			(unsigned long long)(ns / count / 1000));
+	}
+}
+
+/*
+ * Idle-time work: zero one page for the pool, if it needs one and
+ * memory isn't short. Called by the idle loop with interrupts off, so
+ * it only does one page at a time. Returns false if there was nothing
+ * to do. (Before coremap_bootstrap, coremap_nfree is 0, so this never
+ * steals boot memory.)
+ */
+bool
+vm_idle(void)
+{
+	paddr_t pa;
+
+	if (vm_zeropool_num >= VM_ZEROPOOL_MAX ||
+	    coremap_nfree() <= VM_FREEHIGH) {
+		return false;
+	}
+
+	pa = getppages(1);
+	if (pa == 0) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&vm_zeropool_lock);
+	if (vm_zeropool_num < VM_ZEROPOOL_MAX) {
+		vm_zeropool[vm_zeropool_num++] = pa;
+		pa = 0;
+	}
+	spinlock_release(&vm_zeropool_lock);
+
+	if (pa != 0) {
+		/* Another cpu filled it first. */
+		coremap_free(pa);
+		return false;
+	}
+	VM_COUNT(vs_idlezeroed, 1);
+	return true;
+}
+
+void
+vm_printstats(void)
+{
+	struct timespec now;
+	uint64_t ns, total, zerofills, forks, shared, copies;
+	uint64_t pageins, pageouts, stalls, pageinns, pageoutns, stallns;
+	uint64_t batches, shotpages, flushes, ipis, zerohits, idlezeroed;
+	int resident;
+	unsigned i;
+
+	gettime(&now);
+	timespec_sub(&now, &vm_statstart, &now);
+	ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+	total = zerofills = forks = shared = copies = 0;
+	pageins = pageouts = stalls = pageinns = pageoutns = stallns = 0;
+	batches = shotpages = flushes = ipis = zerohits = idlezeroed = 0;
+	resident = 0;
+	kprintf("cpu      tlb faults   bad faults   zero fills\n");
+	for (i=0; i<VM_MAXCPUS; i++) {
+		resident += vm_stats[i].vs_resident;
+		total += vm_stats[i].vs_tlbfaults;
+		zerofills += vm_stats[i].vs_zerofills;
+		zerohits += vm_stats[i].vs_zeropoolhits;
+		idlezeroed += vm_stats[i].vs_idlezeroed;
+		forks += vm_stats[i].vs_forks;
+		shared += vm_stats[i].vs_cowshared;
+		copies += vm_stats[i].vs_cowcopies;
+		pageins += vm_stats[i].vs_pageins;
+		pageouts += vm_stats[i].vs_pageouts;
+		stalls += vm_stats[i].vs_stalls;
+		pageinns += vm_stats[i].vs_pageinns;
+		pageoutns += vm_stats[i].vs_pageoutns;
+		stallns += vm_stats[i].vs_stallns;
+		batches += vm_stats[i].vs_shootbatches;
+		shotpages += vm_stats[i].vs_shootpages;
+		flushes += vm_stats[i].vs_shootflushes;
+		ipis += vm_stats[i].vs_shootipis;
+		if (vm_stats[i].vs_tlbfaults == 0 &&
+		    vm_stats[i].vs_badfaults == 0 &&
+		    vm_stats[i].vs_zerofills == 0) {
+			continue;
+		}
+		kprintf("%3u  %14u  %11u  %11u\n", i,
+			vm_stats[i].vs_tlbfaults, vm_stats[i].vs_badfaults,
+			vm_stats[i].vs_zerofills);
+	}
+	kprintf("%llu TLB refills in %lu.%03lu seconds",
+		(unsigned long long)total, (unsigned long)now.tv_sec,
+		(unsigned long)(now.tv_nsec / 1000000));
+	if (ns >= 1000000) {
+		kprintf(" (%llu/sec)", total * 1000 / (ns / 1000000));
+	}
+	kprintf("\n");
+	kprintf("%llu pages zero-filled, %d user pages resident\n",
+		(unsigned long long)zerofills, resident);
+	kprintf("%llu zero-fills found a pre-zeroed page",
+		(unsigned long long)zerohits);
+	if (zerofills > 0) {
+		kprintf(" (%llu%%)", zerohits * 100 / zerofills);
+	}
+	kprintf("; %llu pages zeroed while idle, %u in the pool\n",
+		(unsigned long long)idlezeroed, vm_zeropool_num);
+	kprintf("%llu forks: %llu pages shared, %llu copied on write",
+		(unsigned long long)forks, (unsigned long long)shared,
+		(unsigned long long)copies);
+	if (forks > 0) {
+		kprintf(" (%llu.%02llu copied per fork)", copies / forks,
+			copies * 100 / forks % 100);
+	}
+	kprintf("\n");
+	vm_printtimes("page-ins", pageins, pageinns);
+	kprintf(", ");
+	vm_printtimes("page-outs", pageouts, pageoutns);
+	kprintf("\n");
+	vm_printtimes("faults stalled for memory", stalls, stallns);
+	kprintf("\n");
+	kprintf("%llu shootdown batches: %llu pages, %llu full flushes, "
+		"%llu IPIs\n", (unsigned long long)batches,
+		(unsigned long long)shotpages, (unsigned long long)flushes,
+		(unsigned long long)ipis);
+	swap_printstats();
+}
+
+void
+vm_resetstats(void)
+{
+	unsigned i;
+
+	for (i=0; i<VM_MAXCPUS; i++) {
+		vm_stats[i].vs_tlbfaults = 0;
+		vm_stats[i].vs_badfaults = 0;
+		vm_stats[i].vs_zerofills = 0;
+		vm_stats[i].vs_zeropoolhits = 0;
+		vm_stats[i].vs_idlezeroed = 0;
+		vm_stats[i].vs_forks = 0;
+		vm_stats[i].vs_cowshared = 0;
+		vm_stats[i].vs_cowcopies = 0;
+		vm_stats[i].vs_pageins = 0;
+		vm_stats[i].vs_pageouts = 0;
+		vm_stats[i].vs_stalls = 0;
+		vm_stats[i].vs_pageinns = 0;
+		vm_stats[i].vs_pageoutns = 0;
+		vm_stats[i].vs_stallns = 0;
+		vm_stats[i].vs_shootbatches = 0;
+		vm_stats[i].vs_shootpages = 0;
+		vm_stats[i].vs_shootflushes = 0;
+		vm_stats[i].vs_shootipis = 0;
+	}
+	gettime(&vm_statstart);
+}
+
+/*
+ * Find the pte for VA in AS, or NULL if there's no second-level
+ * table for it.
+ */
+static
+uint32_t *
+pt_lookup(struct addrspace *as, vaddr_t va)
+{
+	uint32_t *pt;
+
+	if (va >= USERSPACETOP) {
+		return NULL;
+	}
+	pt = as->as_ptdir[PT_DIRINDEX(va)];
+	if (pt == NULL) {
+		return NULL;
+	}
+	return &pt[PT_INDEX(va)];
+}
+
+/*
+ * Set the pte for VADDR in the page table of AS, allocating a
+ * second-level table if needed.
+ */
+static
+int
+pt_map(struct addrspace *as, vaddr_t vaddr, uint32_t pte)
+{
+	uint32_t **pdir;
+	vaddr_t va;
+	paddr_t pa;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	if (vaddr >= USERSPACETOP) {
+		return EFAULT;
+	}
+	pdir = &as->as_ptdir[PT_DIRINDEX(vaddr)];
+	if (*pdir == NULL) {
+		pa = vm_zeropool_get();
+		if (pa != 0) {
+			va = PADDR_TO_KVADDR(pa);
+		}
+		else {
+			va = alloc_kpages(1);
+			if (va == 0) {
+				return ENOMEM;
+			}
+			bzero((void *)va, PAGE_SIZE);
+		}
+		*pdir = (uint32_t *)va;
+	}
+	(*pdir)[PT_INDEX(vaddr)] = pte;
+	return 0;
+}
+
+/*
+ * Free the page table of AS and all the pages and swap slots it
+ * maps. Call with vm_lock held.
+ */
+static
+void
+pt_destroy(struct addrspace *as)
+{
+	uint32_t *pt;
+	paddr_t pa;
+	unsigned i, j;
+
+	for (i=0; i<PT_NDIRS; i++) {
+		pt = as->as_ptdir[i];
+		if (pt == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_NENTRIES; j++) {
+			while (pt[j] & PTE_BUSY) {
+				cv_wait(vm_transitcv, vm_lock);
+			}
+			if (pt[j] & TLBLO_VALID) {
+				pa = pt[j] & TLBLO_PPAGE;
+				coremap_disown(pa, as);
+				if (coremap_free(pa)) {
+					VM_COUNT(vs_resident, -1);
+				}
+			}
+			else if (pt[j] & PTE_SWAPPED) {
+				swap_release(PTE_SLOT(pt[j]));
+			}
+		}
+		free_kpages((vaddr_t)pt);
+	}
+	kfree(as->as_ptdir);
+}
+
+/*
+ * Check if VA lies in one of the regions of AS.
+ */
+static
+bool
+as_inregion(struct addrspace *as, vaddr_t va)
+{
+	if (va >= as->as_vbase1 &&
+	    va < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		return true;
+	}
+	if (va >= as->as_vbase2 &&
+	    va < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		return true;
+	}
+	if (va >= USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE &&
+	    va < USERSTACK) {
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Invalidate the whole TLB of this cpu.
+ */
+static
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	splx(spl);
+}
+
+/*
+ * Invalidate this cpu's TLB entry for VADDR, if it has one.
+ */
+static
+void
+vm_tlbinvalidate(vaddr_t vaddr)
+{
+	int index, spl;
+
+	spl = splhigh();
+	index = tlb_probe(vaddr, 0);
+	if (index >= 0) {
+		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+	}
+	splx(spl);
+}
+
+static
+void
+vm_shoot_init(struct vm_shootbatch *sb)
+{
+	sb->sb_num = 0;
+	sb->sb_total = 0;
+	sb->sb_overflow = false;
+}
+
+/*
+ * Add VADDR of AS to a shootdown batch.
+ */
+static
+void
+vm_shoot_add(struct vm_shootbatch *sb, struct addrspace *as, vaddr_t vaddr)
+{
+	sb->sb_total++;
+	if (sb->sb_num == TLBSHOOTDOWN_MAX) {
+		sb->sb_overflow = true;
+		return;
+	}
+	sb->sb_as[sb->sb_num] = as;
+	sb->sb_vaddr[sb->sb_num] = vaddr;
+	sb->sb_num++;
+}
+
+/*
+ * Check if a cpu whose TLB may hold entries of AS needs a batch.
+ */
+static
+bool
+vm_shoot_wants(const struct vm_shootbatch *sb, struct addrspace *as)
+{
+	unsigned i;
+
+	if (as == NULL) {
+		return false;
+	}
+	if (sb->sb_overflow) {
+		return true;
+	}
+	for (i=0; i<sb->sb_num; i++) {
+		if (sb->sb_as[i] == as) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Send a shootdown batch: invalidate its pages (or everything) here
+ * and on every other cpu that may have them, and wait until that's
+ * done. Call with vm_lock held, after changing the ptes.
+ */
+static
+void
+vm_shoot_send(struct vm_shootbatch *sb)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	struct vm_cpustate *vc;
+	unsigned i, n, ntargets;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	if (sb->sb_num == 0) {
+		return;
+	}
+
+	/* Make the pte changes visible before looking at vc_as. */
+	membar_any_any();
+
+	if (sb->sb_overflow) {
+		vm_tlbflush();
+		ts[0].ts_vaddr = 0;
+		ts[0].ts_flushall = true;
+		ts[0].ts_done = NULL;
+		n = 1;
+	}
+	else {
+		for (i=0; i<sb->sb_num; i++) {
+			vm_tlbinvalidate(sb->sb_vaddr[i]);
+			ts[i].ts_vaddr = sb->sb_vaddr[i];
+			ts[i].ts_flushall = false;
+			ts[i].ts_done = NULL;
+		}
+		n = sb->sb_num;
+	}
+	/* The target acks after the last one. */
+	ts[n-1].ts_done = vm_shootdown_sem;
+
+	ntargets = 0;
+	for (i=0; i<VM_MAXCPUS; i++) {
+		vc = &vm_cpustate[i];
+		if (vc->vc_cpu == NULL || vc->vc_cpu == curcpu->c_self ||
+		    !vm_shoot_wants(sb, vc->vc_as)) {
+			continue;
+		}
+		ipi_tlbshootdown_batch(vc->vc_cpu, ts, n);
+		ntargets++;
+	}
+	for (i=0; i<ntargets; i++) {
+		P(vm_shootdown_sem);
+	}
+
+	VM_COUNT(vs_shootbatches, 1);
+	VM_COUNT(vs_shootpages, sb->sb_total);
+	VM_COUNT(vs_shootflushes, sb->sb_overflow ? 1 : 0);
+	VM_COUNT(vs_shootipis, ntargets);
+	vm_shoot_init(sb);
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	if (ts->ts_flushall) {
+		vm_tlbflush();
+	}
+	else {
+		vm_tlbinvalidate(ts->ts_vaddr);
+	}
+	if (ts->ts_done != NULL) {
+		V(ts->ts_done);
+	}
+}
+
+/*
+ * Get a frame for a user page. If there are none, kick pageout and
+ * wait for it (vm_lock is released meanwhile, so the caller must
+ * look again at whatever it was doing). Returns 0 if memory is full
+ * and nothing more can be paged out. Call with vm_lock held.
+ */
+static
+paddr_t
+vm_getuserpage(void)
+{
+	struct timespec start;
+	paddr_t pa;
+	unsigned gen;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	pa = getppages(1);
+	if (pa == 0) {
+		pa = vm_zeropool_get();
+	}
+	while (pa == 0 && swap_enabled()) {
+		gettime(&start);
+		gen = vm_pageout_gen;
+		V(vm_pageout_sem);
+		while (vm_pageout_gen == gen) {
+			cv_wait(vm_freecv, vm_lock);
+		}
+		VM_COUNT(vs_stalls, 1);
+		VM_COUNT(vs_stallns, vm_elapsed(&start));
+
+		pa = getppages(1);
+		if (pa == 0 && vm_pageout_freed == 0) {
+			/* Nothing left that can be paged out. */
+			break;
+		}
+	}
+
+	if (swap_enabled() && coremap_nfree() < VM_FREELOW) {
+		V(vm_pageout_sem);
+	}
+	return pa;
+}
+
+/*
+ * Page out up to MAX pages, at most one shootdown batch's worth.
+ * Returns how many were paged out. Call with vm_lock held; it's
+ * released during the writes.
+ */
+static
+unsigned
+vm_pageout(unsigned max)
+{
+	struct {
+		struct addrspace *as;
+		vaddr_t va;
+		paddr_t pa;
+		uint32_t *pte;
+		uint32_t oldpte;
+		unsigned slot;
+	} victims[TLBSHOOTDOWN_MAX];
+	struct vm_shootbatch sb;
+	struct timespec start;
+	unsigned i, n, done;
+	int result;
+
+	if (max > TLBSHOOTDOWN_MAX) {
+		max = TLBSHOOTDOWN_MAX;
+	}
+
+	/* Pick the victims and unmap them... */
+	vm_shoot_init(&sb);
+	for (n = 0; n < max; n++) {
+		if (!coremap_victim(&victims[n].pa, &victims[n].as,
+				    &victims[n].va)) {
+			break;
+		}
+		if (swap_alloc(&victims[n].slot)) {
+			coremap_setowner(victims[n].pa, victims[n].as,
+					 victims[n].va);
+			break;
+		}
+
+		victims[n].pte = pt_lookup(victims[n].as, victims[n].va);
+		KASSERT(victims[n].pte != NULL);
+		KASSERT(*victims[n].pte & TLBLO_VALID);
+		KASSERT((*victims[n].pte & TLBLO_PPAGE) == victims[n].pa);
+
+		victims[n].oldpte = *victims[n].pte;
+		*victims[n].pte = SLOT_PTE(victims[n].slot) | PTE_BUSY;
+		vm_shoot_add(&sb, victims[n].as, victims[n].va);
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	/* ...everywhere, so nobody can change them under us... */
+	vm_shoot_send(&sb);
+
+	/* ...and write them out. */
+	lock_release(vm_lock);
+	for (i=0; i<n; i++) {
+		gettime(&start);
+		result = swap_out(victims[i].pa, victims[i].slot);
+		VM_COUNT(vs_pageoutns, vm_elapsed(&start));
+		if (result) {
+			kprintf("vm: pageout: %s\n", strerror(result));
+			victims[i].slot = (unsigned)-1;
+		}
+	}
+	lock_acquire(vm_lock);
+
+	done = 0;
+	for (i=0; i<n; i++) {
+		if (victims[i].slot == (unsigned)-1) {
+			/* Put it back the way it was. */
+			swap_release(PTE_SLOT(*victims[i].pte));
+			*victims[i].pte = victims[i].oldpte;
+			coremap_setowner(victims[i].pa, victims[i].as,
+					 victims[i].va);
+			continue;
+		}
+		*victims[i].pte &= ~(uint32_t)PTE_BUSY;
+		if (!coremap_free(victims[i].pa)) {
+			panic("vm: paged-out frame 0x%x still in use\n",
+			      victims[i].pa);
+		}
+		done++;
+	}
+	VM_COUNT(vs_resident, -(int)done);
+	VM_COUNT(vs_pageouts, done);
+	cv_broadcast(vm_transitcv, vm_lock);
+	return done;
+}
+
+/*
+ * The pageout thread. Each time it's woken, it writes out pages
+ * until VM_FREEHIGH frames are free or it runs out of pages or swap,
+ * then tells any threads waiting for memory how it went.
+ */
+static
+void
+vm_pageout_thread(void *data1, unsigned long data2)
+{
+	unsigned nfree, freed, n;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		P(vm_pageout_sem);
+
+		lock_acquire(vm_lock);
+		freed = 0;
+		while ((nfree = coremap_nfree()) < VM_FREEHIGH) {
+			n = vm_pageout(VM_FREEHIGH - nfree);
+			if (n == 0) {
+				break;
+			}
+			freed += n;
+		}
+		vm_pageout_freed = freed;
+		vm_pageout_gen++;
+		cv_broadcast(vm_freecv, vm_lock);
+		lock_release(vm_lock);
+	}
+}
+
+/*
+ * The part of vm_fault that does more than load the TLB: fault in a
+ * page that isn't there, from swap or zero-filled, or copy a
+ * copy-on-write page on a write. Call with vm_lock held.
+ */
+static
+int
+vm_fault_slow(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	struct timespec start;
+	uint32_t *pte;
+	paddr_t pa, oldpa;
+	unsigned slot;
+	bool zeroed, frompool;
+	int result;
+
+	dumbvm_can_sleep();
+
+	/*
+	 * Any time we sleep the picture can change, so check it all
+	 * again afterwards. PA holds a free frame once we have one;
+	 * ZEROED says if it's known to be zeroed, and FROMPOOL if it came
+	 * ready-zeroed from the pool.
+	 */
+	pa = 0;
+	zeroed = frompool = false;
+	while (1) {
+		pte = pt_lookup(as, va);
+		if (pte != NULL && (*pte & PTE_BUSY)) {
+			cv_wait(vm_transitcv, vm_lock);
+			continue;
+		}
+
+		if (pte != NULL && (*pte & TLBLO_VALID)) {
+			oldpa = *pte & TLBLO_PPAGE;
+			if (faulttype == VM_FAULT_READ ||
+			    (*pte & TLBLO_DIRTY)) {
+				/* Someone else already fixed it. */
+				result = 0;
+				break;
+			}
+			if (coremap_refcount(oldpa) == 1) {
+				/* No longer shared; just take it back. */
+				coremap_setowner(oldpa, as, va);
+				*pte |= TLBLO_DIRTY;
+				result = 0;
+				break;
+			}
+		}
+		else if (pte == NULL || (*pte & PTE_SWAPPED) == 0) {
+			if (!as_inregion(as, va)) {
+				result = EFAULT;
+				break;
+			}
+			/* First touch; try for a page that's ready. */
+			if (pa == 0) {
+				pa = vm_zeropool_get();
+				zeroed = frompool = pa != 0;
+			}
+		}
+
+		/* Everything else needs a new page. */
+		if (pa == 0) {
+			pa = vm_getuserpage();
+			zeroed = frompool = false;
+			if (pa == 0) {
+				return ENOMEM;
+			}
+			continue;
+		}
+
+		if (pte != NULL && (*pte & TLBLO_VALID)) {
+			/* Write to a shared copy-on-write page */
+			memmove((void *)PADDR_TO_KVADDR(pa),
+				(const void *)PADDR_TO_KVADDR(oldpa),
+				PAGE_SIZE);
+			*pte = pa | TLBLO_DIRTY | TLBLO_VALID;
+			coremap_setowner(pa, as, va);
+			VM_COUNT(vs_resident, 1);
+			VM_COUNT(vs_cowcopies, 1);
+
+			/* The other sharers may have gone away meanwhile. */
+			coremap_disown(oldpa, as);
+			if (coremap_free(oldpa)) {
+				VM_COUNT(vs_resident, -1);
+			}
+			return 0;
+		}
+
+		if (pte != NULL && (*pte & PTE_SWAPPED)) {
+			/* Page in; the page is ours alone afterwards. */
+			slot = PTE_SLOT(*pte);
+			*pte |= PTE_BUSY;
+			lock_release(vm_lock);
+			gettime(&start);
+			result = swap_in(slot, pa);
+			VM_COUNT(vs_pageinns, vm_elapsed(&start));
+			lock_acquire(vm_lock);
+			if (result) {
+				*pte &= ~(uint32_t)PTE_BUSY;
+			}
+			else {
+				swap_release(slot);
+				*pte = pa | TLBLO_DIRTY | TLBLO_VALID;
+				coremap_setowner(pa, as, va);
+				VM_COUNT(vs_resident, 1);
+				VM_COUNT(vs_pageins, 1);
+				pa = 0;
+			}
+			cv_broadcast(vm_transitcv, vm_lock);
+			break;
+		}
+
+		/* First touch: zero-fill */
+		if (!zeroed) {
+			bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+			zeroed = true;
+		}
+		result = pt_map(as, va, pa | TLBLO_DIRTY | TLBLO_VALID);
+		if (result == 0) {
+			coremap_setowner(pa, as, va);
+			VM_COUNT(vs_resident, 1);
+			VM_COUNT(vs_zerofills, 1);
+			VM_COUNT(vs_zeropoolhits, frompool ? 1 : 0);
+			pa = 0;
+		}
+		break;
+	}
+
+	if (pa != 0) {
+		coremap_free(pa);
+	}
+	return result;
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
+	uint32_t *pte;
 	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
+	int spl, index, result;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -149,8 +1101,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -176,62 +1126,59 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-	}
-	else {
-		return EFAULT;
-	}
-
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
+	while (1) {
+		pte = pt_lookup(as, faultaddress);
+		if (pte == NULL || (*pte & TLBLO_VALID) == 0 ||
+		    (faulttype != VM_FAULT_READ &&
+		     (*pte & TLBLO_DIRTY) == 0)) {
+			/*
+			 * Not there, or a write to a copy-on-write page.
+			 * (Catching VM_FAULT_WRITE here as well as
+			 * VM_FAULT_READONLY saves a second fault on
+			 * pages not in the TLB.)
+			 */
+			lock_acquire(vm_lock);
+			result = vm_fault_slow(as, faulttype, faultaddress);
+			lock_release(vm_lock);
+			if (result) {
+				VM_COUNT(vs_badfaults, 1);
+				return result;
+			}
+			pte = pt_lookup(as, faultaddress);
+			KASSERT(pte != NULL);
+		}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+		/* Disable interrupts on this CPU while frobbing the TLB. */
+		spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
+		ehi = faultaddress;
+		elo = *pte;
 		if (elo & TLBLO_VALID) {
-			continue;
+			break;
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
+		/* Paged out again already; go round again. */
 		splx(spl);
-		return 0;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, elo & TLBLO_PPAGE);
+	coremap_touch(elo & TLBLO_PPAGE);
+	if (faulttype == VM_FAULT_READONLY) {
+		/* Replace the read-only entry that's already there. */
+		index = tlb_probe(ehi, 0);
+		if (index >= 0) {
+			tlb_write(ehi, elo, index);
+			splx(spl);
+			return 0;
+		}
+	}
+	/*
+	 * A miss means there's no entry for this page in the TLB, so
+	 * there's no need to look for one; any slot will do.
+	 */
+	tlb_random(ehi, elo);
+	VM_COUNT(vs_tlbfaults, 1);
 	splx(spl);
-	return EFAULT;
+	return 0;
 }
 
 struct addrspace *
@@ -243,12 +1190,16 @@ as_create(void)
 	}
 
 	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
 	as->as_npages1 = 0;
 	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
+
+	as->as_ptdir = kmalloc(PT_NDIRS * sizeof(uint32_t *));
+	if (as->as_ptdir == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	bzero(as->as_ptdir, PT_NDIRS * sizeof(uint32_t *));
 
 	return as;
 }
@@ -257,27 +1208,32 @@ void
 as_destroy(struct addrspace *as)
 {
 	dumbvm_can_sleep();
+	lock_acquire(vm_lock);
+	pt_destroy(as);
+	lock_release(vm_lock);
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
+	struct vm_cpustate *vc;
+	int spl;
 
 	as = proc_getas();
 	if (as == NULL) {
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
+	KASSERT(curcpu->c_number < VM_MAXCPUS);
+	vc = &vm_cpustate[curcpu->c_number];
+	vc->vc_cpu = curcpu->c_self;
+	vc->vc_as = as;
+	/* Pairs with vm_shoot_send: publish vc_as before any refill. */
+	membar_any_any();
+	vm_tlbflush();
 	splx(spl);
 }
 
@@ -328,41 +1284,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return ENOSYS;
 }
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
 int
 as_prepare_load(struct addrspace *as)
 {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
-
+	/* Pages are faulted in as the loader touches them. */
 	dumbvm_can_sleep();
-
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
-	}
-
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
-	}
-
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
-	}
-
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
-
+	(void)as;
 	return 0;
 }
 
@@ -377,16 +1304,74 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	KASSERT(as->as_stackpbase != 0);
+	(void)as;
 
 	*stackptr = USERSTACK;
 	return 0;
 }
 
+
+/*
+ * Share every page of OLD with NEW, read-only so the first write to
+ * it copies it. The pages of OLD that were writable are added to SB.
+ * Call with vm_lock held.
+ */
+static
+int
+as_share(struct addrspace *old, struct addrspace *new,
+	 struct vm_shootbatch *sb, unsigned *nshared)
+{
+	uint32_t *pt;
+	unsigned i, j;
+	int result;
+
+	*nshared = 0;
+	for (i=0; i<PT_NDIRS; i++) {
+		pt = old->as_ptdir[i];
+		if (pt == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_NENTRIES; j++) {
+			while (pt[j] & PTE_BUSY) {
+				cv_wait(vm_transitcv, vm_lock);
+			}
+			if (pt[j] & TLBLO_VALID) {
+				if (pt[j] & TLBLO_DIRTY) {
+					pt[j] &= ~(uint32_t)TLBLO_DIRTY;
+					vm_shoot_add(sb, old,
+						     (i << 22) | (j << 12));
+				}
+				coremap_share(pt[j] & TLBLO_PPAGE);
+			}
+			else if (pt[j] & PTE_SWAPPED) {
+				swap_share(PTE_SLOT(pt[j]));
+			}
+			else {
+				continue;
+			}
+			result = pt_map(new, (i << 22) | (j << 12), pt[j]);
+			if (result) {
+				if (pt[j] & TLBLO_VALID) {
+					coremap_free(pt[j] & TLBLO_PPAGE);
+				}
+				else {
+					swap_release(PTE_SLOT(pt[j]));
+				}
+				return result;
+			}
+			(*nshared)++;
+		}
+	}
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	struct vm_shootbatch sb;
+	unsigned nshared;
+	int result;
 
 	dumbvm_can_sleep();
 
@@ -400,27 +1385,20 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
 
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
+	/* Old's TLB entries for the pages it shares are now too lax. */
+	vm_shoot_init(&sb);
+	lock_acquire(vm_lock);
+	result = as_share(old, new, &sb, &nshared);
+	vm_shoot_send(&sb);
+	lock_release(vm_lock);
+
+	if (result) {
 		as_destroy(new);
-		return ENOMEM;
+		return result;
 	}
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
+	VM_COUNT(vs_forks, 1);
+	VM_COUNT(vs_cowshared, nshared);
 
 	*ret = new;
 	return 0;
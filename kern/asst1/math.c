@@ -1,6 +1,8 @@
 #include "opt-synchprobs.h"
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <test.h>
 #include <thread.h>
 #include <synch.h>
@@ -10,6 +12,25 @@
 enum {
         NADDERS = 10,        /* the number of adder threads */
         NADDS   = 10000, /* the number of overall increments to perform */
+        NBATCH  = 100,   /* increments a sharded adder reserves at a time */
+};
+
+/*
+ * The adders can run in one of two modes:
+ *
+ *  ADD_LOCKED  - every increment takes lockA (the original solution).
+ *  ADD_SHARDED - each adder reserves NBATCH increments at a time from
+ *                the global budget, counts them in a thread-local
+ *                shard, and folds its shard back into counter once
+ *                when the budget is exhausted.
+ *
+ * The sharded mode takes lockA roughly NADDS/NBATCH + NADDERS times
+ * in total rather than NADDS times, so it gives a baseline for how
+ * much of the locked run is spent handing the lock around.
+ */
+enum addmode {
+        ADD_LOCKED,
+        ADD_SHARDED,
 };
 
 
@@ -37,6 +58,9 @@ struct semaphore *finished;
 /* lock to lock the critical region when accessing shared resources */
 struct lock *lockA;
 
+/* increments handed out to sharded adders so far, protected by lockA */
+static unsigned long int reserved;
+
 /*
  * **********************************************************************
  * ADD YOUR OWN VARIABLES HERE AS NEEDED
@@ -110,54 +134,101 @@ static void adder(void * unusedpointer, unsigned long addernumber)
 }
 
 /*
- * maths()
- *
- * This function:
+ * reserve_batch()
  *
- * + Initialises the counter variables
- * + Creates a semaphore to wait for adder threads to complete
- * + Starts the define number of adder threads
- * + waits, prints statistics, cleans up, and exits
+ *  Take up to NBATCH increments out of the global budget. Returns the
+ *  number reserved, which is 0 once the budget is used up.
  */
 
-int maths (int data1, char **data2)
+static unsigned long int reserve_batch(void)
 {
-        int index, error;
-        unsigned long int sum;
+        unsigned long int n;
 
-        /*
-         * Avoid unused variable warnings.
-         */
-        (void) data1;
-        (void) data2;
+        lock_acquire(lockA);
+        n = NADDS - reserved;
+        if (n > NBATCH) {
+                n = NBATCH;
+        }
+        reserved += n;
+        lock_release(lockA);
 
-        /* create a semaphore to allow main thread to wait on workers */
+        return n;
+}
 
-        finished = sem_create("finished", 0);
+/*
+ * sharded_adder()
+ *
+ *  Like adder(), but counts into a thread-local shard and only goes
+ *  to lockA to reserve more of the budget and to fold the shard into
+ *  counter at the end.
+ */
 
-        if (finished == NULL) {
-                panic("maths: sem create failed");
+static void sharded_adder(void * unusedpointer, unsigned long addernumber)
+{
+        unsigned long int a, b, n, shard;
+
+        (void) unusedpointer;
+
+        shard = 0;
+        while ((n = reserve_batch()) > 0) {
+                while (n > 0) {
+                        shard++;
+                        n--;
+                }
         }
 
-        /*
-         * ********************************************************************
-         * INSERT ANY INITIALISATION CODE YOU REQUIRE HERE
-         * ********************************************************************
-         */
+        /* fold the shard back into the shared counter */
+        lock_acquire(lockA);
+        a = counter;
+        counter = counter + shard;
+        b = counter;
+        adder_counters[addernumber] += shard;
+        if (a + shard != b) {
+                kprintf("In thread %ld, %ld + %ld == %ld?\n",
+                        addernumber, a, shard, b);
+        }
+        lock_release(lockA);
+
+        V(finished);
+
+        thread_exit();
+}
+
+/*
+ * run_adders()
+ *
+ *  Run one round of NADDERS adders in the given mode, print the usual
+ *  statistics plus the achieved increment rate.
+ */
+
+static void run_adders(enum addmode mode)
+{
+        struct timespec before, after, duration;
+        uint64_t nsecs;
+        int index, error;
+        unsigned long int sum;
+
+        counter = 0;
+        reserved = 0;
+        for (index = 0; index < NADDERS; index++) {
+                adder_counters[index] = 0;
+        }
 
-        /* create lock and ensure it alloc'd correctly */
-        lockA = lock_create("lock_a");
-        KASSERT(lockA != 0);
-        
         /*
          * Start NADDERS adder() threads.
          */
 
-        kprintf("Starting %d adder threads\n", NADDERS);
+        kprintf("Starting %d %s adder threads\n", NADDERS,
+                mode == ADD_SHARDED ? "sharded" : "locked");
+
+        gettime(&before);
 
         for (index = 0; index < NADDERS; index++) {
 
-                error = thread_fork("adder thread", NULL, &adder, NULL, index);
+                error = thread_fork("adder thread", NULL,
+                                    mode == ADD_SHARDED ?
+                                    &sharded_adder : &adder,
+                                    NULL, index);
 
                 /*
                  * panic() on error.
@@ -176,6 +247,9 @@ int maths (int data1, char **data2)
                 P(finished);
         }
 
+        gettime(&after);
+        timespec_sub(&after, &before, &duration);
+
         kprintf("Adder threads performed %ld adds\n", counter);
 
         /* Print out some statistics */
@@ -187,6 +261,74 @@ int maths (int data1, char **data2)
         }
         kprintf("The adders performed %ld increments overall\n", sum);
 
+        nsecs = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+        if (nsecs == 0) {
+                nsecs = 1;
+        }
+        kprintf("%s mode: %llu increments/sec\n",
+                mode == ADD_SHARDED ? "Sharded" : "Locked",
+                (unsigned long long)(sum * (uint64_t)1000000000 / nsecs));
+}
+
+/*
+ * maths()
+ *
+ * This function:
+ *
+ * + Initialises the counter variables
+ * + Creates a semaphore to wait for adder threads to complete
+ * + Starts the define number of adder threads
+ * + waits, prints statistics, cleans up, and exits
+ *
+ * An optional argument selects the mode: "locked" (the default),
+ * "sharded", or "both" to run one after the other for comparison.
+ */
+
+int maths (int nargs, char **args)
+{
+        bool locked, sharded;
+
+        if (nargs == 1 || (nargs == 2 && !strcmp(args[1], "locked"))) {
+                locked = true;
+                sharded = false;
+        } else if (nargs == 2 && !strcmp(args[1], "sharded")) {
+                locked = false;
+                sharded = true;
+        } else if (nargs == 2 && !strcmp(args[1], "both")) {
+                locked = true;
+                sharded = true;
+        } else {
+                kprintf("Usage: 1a [locked|sharded|both]\n");
+                return EINVAL;
+        }
+
+        /* create a semaphore to allow main thread to wait on workers */
+
+        finished = sem_create("finished", 0);
+
+        if (finished == NULL) {
+                panic("maths: sem create failed");
+        }
+
+        /*
+         * ********************************************************************
+         * INSERT ANY INITIALISATION CODE YOU REQUIRE HERE
+         * ********************************************************************
+         */
+
+        /* create lock and ensure it alloc'd correctly; the critical
+           section is a handful of instructions, so spin rather than
+           sleep while the holder is running */
+        lockA = lock_create_adaptive("lock_a");
+        KASSERT(lockA != 0);
+
+        if (locked) {
+                run_adders(ADD_LOCKED);
+        }
+        if (sharded) {
+                run_adders(ADD_SHARDED);
+        }
+
         /*
          * **********************************************************************
          * INSERT ANY CLEANUP CODE YOU REQUIRE HERE
@@ -200,4 +342,3 @@ int maths (int data1, char **data2)
         sem_destroy(finished);
         return 0;
 }
-
@@ -16,20 +16,40 @@
 
 /* lock for tints when used to mix */
 static struct lock *tint_hold[NCOLOURS];    
-/* locks for using the buffer and buffer indicies */
+/* locks for using the buffer, the pending queue and the tint mask */
 static struct lock *bufLock;
 /* sem for blocking customers while paint is mixed */
 static struct semaphore *customer_hold[NCUSTOMERS]; 
-/* sem for blocking sales people from pulling next order while there isn't any */
-static struct semaphore *order_hold;        
+/* cv for blocking sales people while there is no order they can take */
+static struct cv *order_cv;
 /* sem for blocking customers from making orders whilst buffer is full */                                           
 static struct semaphore *buffer_hold;
-/* buffer for holding at most NCUSTOMERS order */
+/* buffer for holding at most NCUSTOMERS order; a slot stays in use from
+   order_paint() until its customer has been served, so that the slot
+   index can name the customer's semaphore */
 static struct paintorder* orderBuf[NCUSTOMERS];
-/* index for start and then end of the order buffer */
-static int bufStart;
-static int bufEnd;
-void sort_tints(unsigned int *tints);
+
+/*
+ * Orders waiting for a staff member, as orderBuf indexes in order of
+ * arrival, and how many times each has been passed over for a later
+ * order.
+ */
+static int pending[NCUSTOMERS];
+static unsigned pending_skips[NCUSTOMERS];
+static int npending;
+
+/* bitmask of the tints (bit tint-1) in orders currently being mixed */
+static unsigned mixing_tints;
+
+/* serve strictly first come, first served instead of batching */
+static bool dispatch_fifo;
+
+/*
+ * An order that has been passed over this many times goes next, even
+ * if that means staff have to wait for its tints to come free.
+ */
+#define MAX_ORDER_SKIPS 4
+
 /*
  * **********************************************************************
  * FUNCTIONS EXECUTED BY CUSTOMER THREADS
@@ -47,21 +67,34 @@ void sort_tints(unsigned int *tints);
 
 void order_paint(struct paintorder *order)
 {
+        int slot;
+
         /* reduce counter so that we don't exceed NCUSTOMERS orders */
         P(buffer_hold);
 
-        /* get bufLock to modify buffer and indicies */
+        /* get bufLock to find a free slot and queue the order */
         lock_acquire(bufLock);
-        bufEnd = (bufEnd + 1) % NCUSTOMERS;
-        order->order_owner = bufEnd;
-        orderBuf[bufEnd] = order;
-        lock_release(bufLock);
+        for (slot = 0; orderBuf[slot] != NULL; slot++) {
+                KASSERT(slot < NCUSTOMERS - 1);
+        }
+        order->order_owner = slot;
+        orderBuf[slot] = order;
+        pending[npending] = slot;
+        pending_skips[npending] = 0;
+        npending++;
 
         /* give shop staff notification that there is an order ready */
-        V(order_hold);
+        cv_signal(order_cv, bufLock);
+        lock_release(bufLock);
 
         /* this will block the customer until a staff unblocks him/her */
         P(customer_hold[order->order_owner]);
+
+        /* done with the slot; let another order have it */
+        lock_acquire(bufLock);
+        orderBuf[order->order_owner] = NULL;
+        lock_release(bufLock);
+        V(buffer_hold);
 }
 
 
@@ -72,6 +105,64 @@ void order_paint(struct paintorder *order)
  * **********************************************************************
  */
 
+/*
+ * tint_mask()
+ *
+ * Returns the set of tints an order needs as a bitmask. Go-home
+ * orders need none; their requested_tints are never filled in.
+ */
+
+static unsigned tint_mask(struct paintorder *order)
+{
+        unsigned mask = 0;
+        int i;
+
+        if (order->go_home_flag) {
+                return 0;
+        }
+
+        for (i = 0; i < PAINT_COMPLEXITY; i++) {
+                if (order->requested_tints[i]) {
+                        mask |= 1U << (order->requested_tints[i] - 1);
+                }
+        }
+        return mask;
+}
+
+/*
+ * choose_order()
+ *
+ * Picks which pending order to hand out next, returning its position
+ * in pending[], or -1 if staff should wait. Must hold bufLock.
+ *
+ * In batching mode this is the oldest order that needs none of the
+ * tints currently being mixed, so that it can be mixed in parallel
+ * with them. Once the oldest order has been passed over
+ * MAX_ORDER_SKIPS times nothing else is handed out until it can go.
+ */
+
+static int choose_order(void)
+{
+        int i;
+
+        if (npending == 0) {
+                return -1;
+        }
+        if (dispatch_fifo || orderBuf[pending[0]]->go_home_flag) {
+                return 0;
+        }
+
+        for (i = 0; i < npending; i++) {
+                if ((tint_mask(orderBuf[pending[i]]) & mixing_tints) == 0) {
+                        return i;
+                }
+                if (i == 0 && pending_skips[0] >= MAX_ORDER_SKIPS) {
+                        break;
+                }
+        }
+        return -1;
+}
+
 /*
  * take_order()
  *
@@ -82,45 +173,35 @@ void order_paint(struct paintorder *order)
 
 struct paintorder *take_order(void)
 {
-        /* block until an order is ready */
-        P(order_hold);
+        struct paintorder *ret;
+        int i, which;
 
-        /* get buflock to modify buffer and indicies */
+        /* get buflock to look at the pending orders */
         lock_acquire(bufLock);
-        struct paintorder *ret = orderBuf[bufStart];
-        bufStart = (bufStart + 1) % NCUSTOMERS;
-        lock_release(bufLock);
 
-        /* let customers know there is one more position to place an order */
-        V(buffer_hold);
+        /* block until there is an order we can take */
+        while ((which = choose_order()) < 0) {
+                cv_wait(order_cv, bufLock);
+        }
 
-        return ret;
-}
+        ret = orderBuf[pending[which]];
+        for (i = 0; i < which; i++) {
+                pending_skips[i]++;
+        }
+        for (i = which; i < npending - 1; i++) {
+                pending[i] = pending[i + 1];
+                pending_skips[i] = pending_skips[i + 1];
+        }
+        npending--;
 
+        /* reserve the tints so nothing conflicting is handed out */
+        if (!dispatch_fifo) {
+                KASSERT((tint_mask(ret) & mixing_tints) == 0);
+                mixing_tints |= tint_mask(ret);
+        }
+        lock_release(bufLock);
 
-/*
- * sort_tints()
- *
- * Uses insertion sort to sort the tints so that lock_acquire can lock
- * the tint locks in order and not cause deadlocks between threads. This
- * algorithm is suitable as we were told that there will be PAINT_COMPLEXITY
- * in the low tens of numbers, and recursion at this low N is a large overhead.
- */
-void sort_tints(unsigned int *tints)
-{
-   int i, j;
-   unsigned int el;
-   for (i = 1; i < PAINT_COMPLEXITY; i++)
-   {
-       j = i-1;
-       el = tints[i];
-       while (j >= 0 && tints[j] > el)
-       {
-           tints[j+1] = tints[j];
-           j = j-1;
-       }
-       tints[j+1] = el;
-   }
+        return ret;
 }
 
 
@@ -133,33 +214,43 @@ void sort_tints(unsigned int *tints)
  * NOTE: IT NEEDS TO ENSURE THAT MIX HAS EXCLUSIVE ACCESS TO THE
  * REQUIRED TINTS (AND, IDEALLY, ONLY THE TINTS) IT NEEDS TO USE TO
  * FILL THE ORDER.
+ *
+ * The tint locks are taken all at once with lock_acquire_set, so a
+ * staff member never sits on RED while waiting for BLUE and holding
+ * up everyone who only needs RED.
  */
 
 void fill_order(struct paintorder *order)
 {
 
         int i;
+        unsigned n;
         int tint; /* index tints, starting at 0 rather than 1 */
         unsigned int *tints = order->requested_tints;
-        sort_tints(tints); /* sort to prevent deadlocking later */
         unsigned char locked_tints[NCOLOURS] = {0}; /* prevent double-locking
                                                        a lock for no reason */
+        struct lock *needed[PAINT_COMPLEXITY];
 
-        /* lock tint locks which correspond to ones that this order needs */
+        /* collect the distinct tint locks this order needs */
+        n = 0;
         for (i = 0; i < PAINT_COMPLEXITY; i++) {
                 tint = tints[i] - 1;
                 if (tints[i] && !locked_tints[tint]) {
-                        lock_acquire(tint_hold[tint]);
+                        needed[n++] = tint_hold[tint];
                         locked_tints[tint] = 1;
                 }
         }
+
+        lock_acquire_set(needed, n);
         mix(order);
-        for (i = (PAINT_COMPLEXITY - 1); i >= 0; i--) {
-                tint = tints[i] - 1;
-                if (tints[i] && locked_tints[tint]) {
-                        lock_release(tint_hold[tint]); 
-                        locked_tints[tint] = 0;
-                }
+        lock_release_set(needed, n);
+
+        /* hand the tints back to the dispatcher and wake waiting staff */
+        if (!dispatch_fifo) {
+                lock_acquire(bufLock);
+                mixing_tints &= ~tint_mask(order);
+                cv_broadcast(order_cv, bufLock);
+                lock_release(bufLock);
         }
 }
 
@@ -197,16 +288,17 @@ void serve_order(struct paintorder *order)
 void paintshop_open(void)
 {
         int i;
-        bufStart = 0;
-        bufEnd = NCUSTOMERS - 1;
-        bufLock = lock_create("buf_lock");
-        order_hold = sem_create("order_hold_sem", 0); 
+        npending = 0;
+        mixing_tints = 0;
+        bufLock = lock_create_adaptive("buf_lock");
+        order_cv = cv_create("order_cv");
         buffer_hold = sem_create("buffer_hold_sem", NCUSTOMERS);
         /* create and name semaphores for each customer */
         for (i = 0; i < NCUSTOMERS; i++){
                 char *semName = (char *)kmalloc(21);
                 snprintf(semName, 21, "customer_hold_sem_%d", i);
                 customer_hold[i] = sem_create(semName, 0);
+                orderBuf[i] = NULL;
         }
         /* create and name locks for each tint */
         for (i = 0;  i < NCOLOURS; i++) {
@@ -216,6 +308,18 @@ void paintshop_open(void)
         }
 }
 
+/*
+ * paintshop_set_fifo()
+ *
+ * Choose between strict first come, first served order dispatch and
+ * tint-aware batching. Call before paintshop_open().
+ */
+
+void paintshop_set_fifo(bool fifo)
+{
+        dispatch_fifo = fifo;
+}
+
 /*
  * paintshop_close()
  *
@@ -227,8 +331,10 @@ void paintshop_close(void)
 {
         int i;
         /* clean up ALL THE THINGS */
+        KASSERT(npending == 0);
+        KASSERT(mixing_tints == 0);
         lock_destroy(bufLock);
-        sem_destroy(order_hold);
+        cv_destroy(order_cv);
         sem_destroy(buffer_hold);
         for (i = 0; i < NCOLOURS; i++) {
                 lock_destroy(tint_hold[i]);
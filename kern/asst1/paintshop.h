@@ -24,4 +24,8 @@ struct paintorder {
 
 };
 
+/* Select first come, first served (true) or tint-batched (false)
+   order dispatch for the next run */
+void paintshop_set_fifo(bool fifo);
+
 #endif
@@ -1,6 +1,8 @@
 #include "opt-synchprobs.h"
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <synch.h>
 #include <test.h>
 #include <thread.h>
@@ -17,6 +19,9 @@
 
 /* #define PRINT_ON */
 
+/* The number of cans each customer orders before going home */
+#define NORDERS 10
+
 /* this semaphore is for cleaning up at the end. */
 static struct semaphore *alldone;
 
@@ -33,6 +38,30 @@ struct paint_tint paint_tints[NCOLOURS];
 static int customers;
 static struct lock *cust_lock;
 
+/*
+ * Staff utilization statistics. Each staff member records how long it
+ * spends in fill_order(); mix() records the time spent actually
+ * mixing, with the tints held. The difference is time lost waiting
+ * for tints, and total mixing time over elapsed time is the average
+ * number of orders being mixed in parallel.
+ */
+static uint64_t staff_fill_ns[NPAINTSHOPSTAFF];
+static uint64_t total_mix_ns;
+static struct spinlock mix_stats_lock = SPINLOCK_INITIALIZER;
+
+/* How long each customer waited for each order, from ordering to being
+   served. Each customer only writes its own row. */
+static uint64_t customer_wait_ns[NCUSTOMERS][NORDERS];
+
+static uint64_t elapsed_ns(const struct timespec *before)
+{
+        struct timespec after, duration;
+
+        gettime(&after);
+        timespec_sub(&after, before, &duration);
+        return (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+}
+
 /* A function used to manage staff leaving */
 
 static void go_home(void);
@@ -58,6 +87,7 @@ static void go_home(void);
 static void customer(void *unusedpointer, unsigned long customernum)
 {
         struct paintorder order;
+        struct timespec start;
         int i,j;
 
         (void) unusedpointer; /* avoid compiler warning */
@@ -80,7 +110,9 @@ static void customer(void *unusedpointer, unsigned long customernum)
 
 
                 /* order the paint, this blocks until the order is filled */
+                gettime(&start);
                 order_paint(&order);
+                customer_wait_ns[customernum][i] = elapsed_ns(&start);
 
 
 #ifdef PRINT_ON
@@ -101,7 +133,7 @@ static void customer(void *unusedpointer, unsigned long customernum)
                 thread_yield();
 
                 i++;
-        } while (i < 10); /* keep going until .... */
+        } while (i < NORDERS); /* keep going until .... */
 
 #ifdef PRINT_ON
         kprintf("C %ld going home\n", customernum);
@@ -134,6 +166,7 @@ static void paintshop_staff(void *unusedpointer, unsigned long staff)
 {
 
         struct paintorder *order;
+        struct timespec start;
         int i;
         (void)unusedpointer; /* avoid compiler warning */
 
@@ -154,7 +187,9 @@ static void paintshop_staff(void *unusedpointer, unsigned long staff)
 
 
                         i++;
+                        gettime(&start);
                         fill_order(order);
+                        staff_fill_ns[staff] += elapsed_ns(&start);
 
 #ifdef PRINT_ON
                         kprintf("S %ld serving\n", staff);
@@ -188,12 +223,51 @@ static void paintshop_staff(void *unusedpointer, unsigned long staff)
  *
  */
 
+/*
+ * Print the mean and 99th percentile of the customer wait times. Sorts
+ * customer_wait_ns in place.
+ */
+static void print_wait_stats(void)
+{
+        uint64_t *waits = &customer_wait_ns[0][0];
+        uint64_t w, sum;
+        unsigned i, j, n, p99;
+
+        n = NCUSTOMERS * NORDERS;
+
+        /* insertion sort; n is small */
+        sum = 0;
+        for (i = 0; i < n; i++) {
+                w = waits[i];
+                sum += w;
+                for (j = i; j > 0 && waits[j - 1] > w; j--) {
+                        waits[j] = waits[j - 1];
+                }
+                waits[j] = w;
+        }
+
+        /* nearest-rank percentile */
+        p99 = (n * 99 + 99) / 100 - 1;
+
+        kprintf("Customer wait: mean %llu us, p99 %llu us over %u orders\n",
+                (unsigned long long)(sum / n / 1000),
+                (unsigned long long)(waits[p99] / 1000), n);
+}
+
 int run_paintshop(int nargs, char **args)
 {
+        struct timespec start;
+        uint64_t elapsed, fill;
         int i, result;
 
-        (void) nargs; /* avoid compiler warnings */
-        (void) args;
+        if (nargs == 1 || !strcmp(args[1], "batch")) {
+                paintshop_set_fifo(false);
+        } else if (nargs == 2 && !strcmp(args[1], "fifo")) {
+                paintshop_set_fifo(true);
+        } else {
+                kprintf("Usage: 1d [batch|fifo]\n");
+                return EINVAL;
+        }
 
         /* this semaphore indicates everybody has gone home */
         alldone = sem_create("alldone", 0);
@@ -206,6 +280,11 @@ int run_paintshop(int nargs, char **args)
                 paint_tints[i].doses = 0;
         }
 
+        for (i = 0; i < NPAINTSHOPSTAFF; i++) {
+                staff_fill_ns[i] = 0;
+        }
+        total_mix_ns = 0;
+
         /* initialise the count of customers and create a lock to
            facilitate updating the counter by multiple threads */
         customers = NCUSTOMERS;
@@ -219,6 +298,7 @@ int run_paintshop(int nargs, char **args)
          * call your routine that initialises the rest of the paintshop
          */
         paintshop_open();
+        gettime(&start);
 
         /* Start the paint shop staff */
         for (i=0; i<NPAINTSHOPSTAFF; i++) {
@@ -245,12 +325,33 @@ int run_paintshop(int nargs, char **args)
         for (i=0; i< NCUSTOMERS+NPAINTSHOPSTAFF; i++) {
                 P(alldone);
         }
+        elapsed = elapsed_ns(&start);
+        if (elapsed == 0) {
+                elapsed = 1;
+        }
 
         for (i =0 ; i < NCOLOURS; i++) {
                 kprintf("Tint %d used for %d doses\n", i+1,
                         paint_tints[i].doses);
         }
 
+        fill = 0;
+        for (i = 0; i < NPAINTSHOPSTAFF; i++) {
+                kprintf("Staff %d busy filling orders %llu%% of the time\n",
+                        i, (unsigned long long)
+                        (staff_fill_ns[i] * 100 / elapsed));
+                fill += staff_fill_ns[i];
+        }
+        kprintf("Staff time spent mixing: %llu%%, waiting for tints: %llu%%\n",
+                (unsigned long long)
+                (total_mix_ns * 100 / (elapsed * NPAINTSHOPSTAFF)),
+                (unsigned long long)
+                ((fill - total_mix_ns) * 100 / (elapsed * NPAINTSHOPSTAFF)));
+        kprintf("Average mix parallelism: %llu.%02llu\n",
+                (unsigned long long)(total_mix_ns / elapsed),
+                (unsigned long long)(total_mix_ns * 100 / elapsed % 100));
+        print_wait_stats();
+
         /***********************************************************************
          * Call your paint shop clean up routine
          */
@@ -284,8 +385,12 @@ int run_paintshop(int nargs, char **args)
 
 void mix(struct paintorder *order)
 {
+        struct timespec start;
+        uint64_t ns;
         int i;
 
+        gettime(&start);
+
         /* add tints to can in order given and increment number of
            doses from particular tint */
 
@@ -301,6 +406,11 @@ void mix(struct paintorder *order)
                         paint_tints[col-1].doses++;
                 }
         }
+
+        ns = elapsed_ns(&start);
+        spinlock_acquire(&mix_stats_lock);
+        total_mix_ns += ns;
+        spinlock_release(&mix_stats_lock);
 }
 
 /*
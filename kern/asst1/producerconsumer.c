@@ -1,42 +1,266 @@
 /* This file will contain your solution. Modify it as you wish. */
 #include <types.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <wchan.h>
 #include <synch.h>  /* for P(), V(), sem_* */
 #include <lib.h>    /* for kprintf */
 #include "producerconsumer_driver.h"
 
-/* Declare any variables you need here to keep track of and
-   synchronise your bounded. A sample declaration of a buffer is shown
-   below. You can change this if you choose another implementation. */
-
-static struct pc_data buffer[BUFFER_SIZE]; /* Data item buffer */
-int bufStart;   /* Points to the current data item at front of queue */
-int bufEnd;     /* Points to the last element in the queue */
-struct lock *bufLock; /* Lock to control access to buffer and indexes */
-struct semaphore *producer_hold; /* Mutex to control blocking within 
-                                    producer_send() */
-struct semaphore *consumer_hold; /* Mutex to control blocking within 
-                                    consumer_reveive() */
+/*
+ * The bounded buffer is a lock-free ring of BUFFER_SIZE slots, shared
+ * by any number of producers and consumers.
+ *
+ * Each slot carries a sequence number saying whose turn it is. For a
+ * ring position pos, the slot ring[pos % BUFFER_SIZE] is free for the
+ * producer at pos while its sequence is pos, and holds data for the
+ * consumer at pos once the producer sets it to pos+1. The consumer
+ * then hands it on to the producer one lap later by setting it to
+ * pos+BUFFER_SIZE.
+ *
+ * Producers claim a position by compare-and-swapping ring_tail
+ * forward, consumers likewise with ring_head. Neither side takes a
+ * lock on the fast path. Only when the ring is actually full (or
+ * empty) does a thread go to sleep on a wait channel, and the other
+ * side only takes the spinlock to wake it if it sees a sleeper.
+ *
+ * Positions run modulo RING_WRAP rather than modulo 2^32, so that
+ * pos % BUFFER_SIZE stays continuous across the wrap for any buffer
+ * size, not just powers of two.
+ */
+
+#define RING_WRAP (BUFFER_SIZE * (0x40000000U / BUFFER_SIZE))
+
+struct pc_slot {
+        volatile spinlock_data_t seq;   /* ring position this slot is at */
+        struct pc_data data;
+};
+
+static struct pc_slot ring[BUFFER_SIZE];
+static volatile spinlock_data_t ring_head;  /* next position to consume */
+static volatile spinlock_data_t ring_tail;  /* next position to produce */
+
+/* Slow path: sleeping when the ring is full or empty */
+static struct spinlock ring_lock;       /* protects both wchans */
+static struct wchan *send_wchan;        /* producers waiting for space */
+static struct wchan *recv_wchan;        /* consumers waiting for data */
+static volatile unsigned send_waiters;  /* threads on send_wchan */
+static volatile unsigned recv_waiters;  /* threads on recv_wchan */
+
+/* Advance a ring position by n, wrapping at RING_WRAP. */
+static unsigned ring_add(unsigned pos, unsigned n)
+{
+        pos += n;
+        if (pos >= RING_WRAP) {
+                pos -= RING_WRAP;
+        }
+        return pos;
+}
+
+/* Signed distance from ring position b to ring position a. */
+static int ring_diff(unsigned a, unsigned b)
+{
+        int d = (int)a - (int)b;
+
+        if (d > (int)(RING_WRAP / 2)) {
+                d -= RING_WRAP;
+        } else if (d < -(int)(RING_WRAP / 2)) {
+                d += RING_WRAP;
+        }
+        return d;
+}
+
+/*
+ * Try to put up to N items in the ring without blocking. Returns the
+ * number actually sent, which is 0 if the ring is full.
+ *
+ * A run of consecutive free slots is claimed with a single
+ * compare-and-swap on ring_tail. This is safe because a slot that is
+ * free for position pos can only be taken by whoever moves ring_tail
+ * past pos, so if the CAS succeeds every slot we checked is ours.
+ */
+static unsigned ring_trysend(const struct pc_data *items, unsigned n)
+{
+        unsigned pos, k, j;
+        int d;
+
+        pos = spinlock_data_get(&ring_tail);
+        while (1) {
+                d = ring_diff(spinlock_data_get(&ring[pos % BUFFER_SIZE].seq),
+                              pos);
+                if (d < 0) {
+                        /* a consumer is still a lap behind: full */
+                        return 0;
+                }
+                if (d == 0) {
+                        /* count how many slots from here are free */
+                        k = 1;
+                        while (k < n && k < BUFFER_SIZE &&
+                               ring_diff(spinlock_data_get(
+                                  &ring[ring_add(pos, k) % BUFFER_SIZE].seq),
+                                         ring_add(pos, k)) == 0) {
+                                k++;
+                        }
+                        if (spinlock_data_compareandswap(&ring_tail, pos,
+                                                         ring_add(pos, k))) {
+                                break;
+                        }
+                }
+                /* someone else got there first; look again */
+                pos = spinlock_data_get(&ring_tail);
+        }
+
+        for (j = 0; j < k; j++) {
+                struct pc_slot *slot = &ring[ring_add(pos, j) % BUFFER_SIZE];
+
+                slot->data = items[j];
+                membar_store_store();
+                spinlock_data_set(&slot->seq, ring_add(pos, j + 1));
+        }
+        return k;
+}
+
+/*
+ * Try to take up to MAX items from the ring without blocking. Returns
+ * the number actually received, which is 0 if the ring is empty.
+ * Claims a run of filled slots with one CAS on ring_head, as above.
+ */
+static unsigned ring_tryreceive(struct pc_data *items, unsigned max)
+{
+        unsigned pos, k, j;
+        int d;
+
+        pos = spinlock_data_get(&ring_head);
+        while (1) {
+                d = ring_diff(spinlock_data_get(&ring[pos % BUFFER_SIZE].seq),
+                              ring_add(pos, 1));
+                if (d < 0) {
+                        /* no producer has filled it yet: empty */
+                        return 0;
+                }
+                if (d == 0) {
+                        /* count how many slots from here are filled */
+                        k = 1;
+                        while (k < max && k < BUFFER_SIZE &&
+                               ring_diff(spinlock_data_get(
+                                  &ring[ring_add(pos, k) % BUFFER_SIZE].seq),
+                                         ring_add(pos, k + 1)) == 0) {
+                                k++;
+                        }
+                        if (spinlock_data_compareandswap(&ring_head, pos,
+                                                         ring_add(pos, k))) {
+                                break;
+                        }
+                }
+                pos = spinlock_data_get(&ring_head);
+        }
+
+        membar_load_load();
+        for (j = 0; j < k; j++) {
+                struct pc_slot *slot = &ring[ring_add(pos, j) % BUFFER_SIZE];
+
+                items[j] = slot->data;
+                membar_any_store();
+                spinlock_data_set(&slot->seq,
+                                  ring_add(pos, j + BUFFER_SIZE));
+        }
+        return k;
+}
+
+/*
+ * Wake up to N threads sleeping on WC if WAITERS says there may be
+ * any. N is the number of slots (or items) just made available, so we
+ * wake exactly as many threads as can make progress.
+ *
+ * The full barrier orders the ring update we just made before the
+ * read of the waiter count; the sleeper increments its count and
+ * then retries the ring (also under a barrier) before sleeping, so
+ * one side or the other always notices.
+ */
+static void ring_wake(struct wchan *wc, volatile unsigned *waiters,
+                      unsigned n)
+{
+        membar_any_any();
+        if (*waiters > 0) {
+                spinlock_acquire(&ring_lock);
+                while (n > 0 && !wchan_isempty(wc, &ring_lock)) {
+                        wchan_wakeone(wc, &ring_lock);
+                        n--;
+                }
+                spinlock_release(&ring_lock);
+        }
+}
+
+/*
+ * consumer_receive_batch() takes between 1 and MAX items from the
+ * buffer, blocking only if it is empty, and returns how many it got.
+ */
+
+unsigned consumer_receive_batch(struct pc_data *items, unsigned max)
+{
+        unsigned got;
+
+        KASSERT(max > 0);
+
+        got = ring_tryreceive(items, max);
+        if (got == 0) {
+                /* ring looked empty; take the slow path */
+                spinlock_acquire(&ring_lock);
+                recv_waiters++;
+                membar_any_any();
+                while ((got = ring_tryreceive(items, max)) == 0) {
+                        wchan_sleep(recv_wchan, &ring_lock);
+                }
+                recv_waiters--;
+                spinlock_release(&ring_lock);
+        }
+
+        /* slots just came free; let that many blocked producers go */
+        ring_wake(send_wchan, &send_waiters, got);
+        return got;
+}
+
+/*
+ * producer_send_batch() puts all N items in the buffer, in order,
+ * moving as many at a time as there is room for and blocking only
+ * while it is full.
+ */
+
+void producer_send_batch(const struct pc_data *items, unsigned n)
+{
+        unsigned sent;
+
+        while (n > 0) {
+                sent = ring_trysend(items, n);
+                if (sent == 0) {
+                        /* ring looked full; take the slow path */
+                        spinlock_acquire(&ring_lock);
+                        send_waiters++;
+                        membar_any_any();
+                        while ((sent = ring_trysend(items, n)) == 0) {
+                                wchan_sleep(send_wchan, &ring_lock);
+                        }
+                        send_waiters--;
+                        spinlock_release(&ring_lock);
+                }
+
+                /* items just arrived; let that many consumers go */
+                ring_wake(recv_wchan, &recv_waiters, sent);
+
+                items += sent;
+                n -= sent;
+        }
+}
+
 /* consumer_receive() is called by a consumer to request more data. It
    should block on a sync primitive if no data is available in your
    buffer. */
 
 struct pc_data consumer_receive(void)
 {
-        /* Block if 10 consumers have emptied the buffer without a producer 
-         * creating a signal. Effectively the number of items in buf. */
-        P(consumer_hold);
-
         struct pc_data thedata;
- 
-        /* critical region, acquire lock */
-        lock_acquire(bufLock);
-        thedata = buffer[bufStart];
-        bufStart = (bufStart+1) % BUFFER_SIZE;
-        lock_release(bufLock);
-        /* critical region, release lock */
-
-        /* Signal to the producer that a consumer has consumed an item */
-        V(producer_hold);
+
+        consumer_receive_batch(&thedata, 1);
         return thedata;
 }
 
@@ -45,20 +269,7 @@ struct pc_data consumer_receive(void)
 
 void producer_send(struct pc_data item)
 {
-        /* Block if 10 producers have filled the buffer without a consumer 
-         * creating a signal. Effectively the number of free spots in buf. */
-        P(producer_hold);
-
-        /* critical region, acquire lock */
-        lock_acquire(bufLock);
-        bufEnd = (bufEnd + 1) % BUFFER_SIZE;
-        buffer[bufEnd] = item;
-        lock_release(bufLock);
-        /* critical region, release lock */
-
-        /* Signal to the consumer that a producer has produced an item */
-        V(consumer_hold);
-        return;
+        producer_send_batch(&item, 1);
 }
 
 
@@ -69,27 +280,33 @@ void producer_send(struct pc_data item)
 
 void producerconsumer_startup(void)
 {
-        bufStart = 0;
-        bufEnd = BUFFER_SIZE - 1;
-
-        /* create locks and semaphores and make 
-         * sure they allocated correctly */
-        
-        producer_hold = sem_create("producer_hold", BUFFER_SIZE);
-        KASSERT(producer_hold != 0);
-        consumer_hold = sem_create("consumer_hold", 0);
-        KASSERT(consumer_hold != 0);
-        
-        bufLock = lock_create("bufLock");
-        KASSERT(bufLock != 0);
+        unsigned i;
+
+        for (i = 0; i < BUFFER_SIZE; i++) {
+                spinlock_data_set(&ring[i].seq, i);
+        }
+        spinlock_data_set(&ring_head, 0);
+        spinlock_data_set(&ring_tail, 0);
+
+        spinlock_init(&ring_lock);
+        send_waiters = 0;
+        recv_waiters = 0;
+
+        send_wchan = wchan_create("pc_send");
+        KASSERT(send_wchan != NULL);
+        recv_wchan = wchan_create("pc_recv");
+        KASSERT(recv_wchan != NULL);
+
+        membar_any_any();
 }
 
 /* Perform any clean-up you need here */
 void producerconsumer_shutdown(void)
 {
         /* clean up all memory */
-        lock_destroy(bufLock);
-        sem_destroy(producer_hold);
-        sem_destroy(consumer_hold);
+        KASSERT(send_waiters == 0);
+        KASSERT(recv_waiters == 0);
+        wchan_destroy(send_wchan);
+        wchan_destroy(recv_wchan);
+        spinlock_cleanup(&ring_lock);
 }
-
@@ -10,7 +10,9 @@
  */
 #include "opt-synchprobs.h"
 #include <types.h>  /* required by lib.h */
+#include <kern/errno.h>
 #include <lib.h>    /* for kprintf */
+#include <clock.h>  /* for gettime() */
 #include <synch.h>  /* for P(), V(), sem_* */
 #include <thread.h> /* for thread_fork() */
 #include <test.h>
@@ -38,6 +40,15 @@
  */
 #define SOMETHING_WRONG_COUNT 10000
 
+/* Largest batch size accepted on the command line. */
+#define MAX_BATCH 64
+
+/* Number of items producers send, and consumers ask for, at a time.
+ * 1 uses the single-item producer_send()/consumer_receive() calls;
+ * anything larger uses the batched versions.
+ */
+static unsigned batch_size;
+
 /* Semaphores which the simulator uses to determine when all
  * producer threads and all consumer threads have finished.
  */
@@ -51,7 +62,8 @@ static struct semaphore *producer_finished;
 static void
 producer_thread(void *unused_ptr, unsigned long thread_num)
 {
-        struct pc_data thedata;
+        struct pc_data batch[MAX_BATCH];
+        unsigned n;
         int items_to_go = ITEMS_TO_PRODUCE;
 
         (void)unused_ptr; /* Avoid compiler warnings */
@@ -59,15 +71,23 @@ producer_thread(void *unused_ptr, unsigned long thread_num)
         kprintf("Producer started\n");
 
         while(items_to_go > 0) {
-                thedata.item1 = items_to_go + (1000 * thread_num);
-                /* Set second data item as related to the first so that
-                 * the consumer can check both numbers are valid
-                 */
-                thedata.item2 = thedata.item1 + 1;
-
-                producer_send(thedata);
+                n = 0;
+                while (n < batch_size && items_to_go > 0) {
+                        batch[n].item1 = items_to_go + (1000 * thread_num);
+                        /* Set second data item as related to the first
+                         * so that the consumer can check both numbers
+                         * are valid
+                         */
+                        batch[n].item2 = batch[n].item1 + 1;
+                        n++;
+                        items_to_go = items_to_go - 1;
+                }
 
-                items_to_go = items_to_go - 1;
+                if (n == 1) {
+                        producer_send(batch[0]);
+                } else {
+                        producer_send_batch(batch, n);
+                }
         }
 
         /* No more items... Signal that we're done. */
@@ -77,14 +97,15 @@ producer_thread(void *unused_ptr, unsigned long thread_num)
 
 /* The consumer thread's only function. NUM_CONSUMERS threads are started,
  * each of which runs this function. The function continuously calls
- * consumer_receive() until it receives a special data item containing
- * two zero integers. NOTE: Don't rely on this specific protocol when designing
+ * consumer_receive() (or consumer_receive_batch()) until it receives a
+ * special data item containing two zero integers. NOTE: Don't rely on this specific protocol when designing
  * your producer_send() and consumer_receive() functions!
  */
 static void
 consumer_thread(void *unused_ptr, unsigned long thread_num)
 {
-        struct pc_data thedata;
+        struct pc_data batch[MAX_BATCH];
+        unsigned i, n, nstop;
         int check_count = 0;
 
         (void)unused_ptr;
@@ -92,24 +113,48 @@ consumer_thread(void *unused_ptr, unsigned long thread_num)
 
         kprintf("Consumer started\n");
 
-        thedata = consumer_receive();
+        nstop = 0;
+        while (nstop == 0) {
+                if (batch_size == 1) {
+                        batch[0] = consumer_receive();
+                        n = 1;
+                } else {
+                        n = consumer_receive_batch(batch, batch_size);
+                }
 
-        while (thedata.item1 != 0 || thedata.item2 != 0) {
-                if (++check_count >= SOMETHING_WRONG_COUNT) {
+                for (i = 0; i < n; i++) {
+                        if (batch[i].item1 == 0 && batch[i].item2 == 0) {
+                                nstop++;
+                                continue;
+                        }
+
+                        /* check we receive sane results */
+                        if(batch[i].item1 +1 != batch[i].item2) {
+                                kprintf("*** Error! Unexpected data %d and %d\n",
+                                        batch[i].item1, batch[i].item2);
+                        }
+                        check_count++;
+                }
+
+                if (check_count >= SOMETHING_WRONG_COUNT) {
                         /*
                          * something must be wrong if we received this many
                          * items.
                          */
                         break;
                 }
+        }
 
-                /* check we receive sane results */
-                if(thedata.item1 +1 != thedata.item2) {
-                        kprintf("*** Error! Unexpected data %d and %d\n",
-                                thedata.item1, thedata.item2);
-                }
-
-                thedata = consumer_receive();
+        /*
+         * A batch can scoop up other consumers' stop messages along
+         * with our own. They are always at the end of the stream, so
+         * just put the extras back for the others to find.
+         */
+        while (nstop > 1) {
+                batch[0].item1 = 0;
+                batch[0].item2 = 0;
+                producer_send(batch[0]);
+                nstop--;
         }
 
         if (check_count >= SOMETHING_WRONG_COUNT) {
@@ -205,10 +250,21 @@ stop_consumer_threads()
 int
 run_producerconsumer(int nargs, char **args)
 {
-        (void) nargs; /* Avoid "unused variable" warning */
-        (void) args;
+        struct timespec before, after, duration;
+        uint64_t nsecs, nitems;
+
+        if (nargs == 1) {
+                batch_size = 1;
+        } else if (nargs == 2 && atoi(args[1]) > 0 &&
+                   atoi(args[1]) <= MAX_BATCH) {
+                batch_size = atoi(args[1]);
+        } else {
+                kprintf("Usage: 1c [batchsize (1-%d)]\n", MAX_BATCH);
+                return EINVAL;
+        }
 
-        kprintf("run_producerconsumer: starting up\n");
+        kprintf("run_producerconsumer: starting up, batch size %u\n",
+                batch_size);
 
         /* Initialise synch primitives used in this simulator */
         consumer_finished = sem_create("consumer_finished", 0);
@@ -225,6 +281,7 @@ run_producerconsumer(int nargs, char **args)
         producerconsumer_startup();
 
         /* Run the simulation */
+        gettime(&before);
         start_consumer_threads();
         start_producer_threads();
 
@@ -232,6 +289,18 @@ run_producerconsumer(int nargs, char **args)
 
         wait_for_producer_threads();
         stop_consumer_threads();
+        gettime(&after);
+
+        /* Report throughput, counting the stop messages as items too */
+        timespec_sub(&after, &before, &duration);
+        nsecs = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+        if (nsecs == 0) {
+                nsecs = 1;
+        }
+        nitems = NUM_PRODUCERS * ITEMS_TO_PRODUCE + NUM_CONSUMERS;
+        kprintf("run_producerconsumer: %llu items in %llu ns, %llu items/sec\n",
+                (unsigned long long)nitems, (unsigned long long)nsecs,
+                (unsigned long long)(nitems * 1000000000 / nsecs));
 
         /* Run any code required to shut down the simulation */
         producerconsumer_shutdown();
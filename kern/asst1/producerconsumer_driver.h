@@ -43,6 +43,16 @@ struct pc_data consumer_receive(void); /* receive a data item, blocking
 void producer_send(struct pc_data); /* send a data item to the shared
                                        buffer */
 
+unsigned consumer_receive_batch(struct pc_data *, unsigned max);
+                                    /* receive between 1 and max items,
+                                       blocking only if none are
+                                       available; returns the number
+                                       received */
+
+void producer_send_batch(const struct pc_data *, unsigned n);
+                                    /* send n items, as many at a time
+                                       as fit in the buffer */
+
 void producerconsumer_startup(void); /* initialise your buffer and
                                         surrounding code */
 
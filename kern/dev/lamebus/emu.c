@@ -46,6 +46,7 @@
 #include <stat.h>
 #include <lib.h>
 #include <array.h>
+#include <ihash.h>
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
@@ -469,16 +470,13 @@ emufs_reclaim(struct vnode *v)
 {
 	struct emufs_vnode *ev = v->vn_data;
 	struct emufs_fs *ef = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
 	/*
-	 * Need all of these locks, e_lock to protect the device,
-	 * vfs_biglock to protect the fs-related material, and
-	 * vn_countlock for the reference count.
+	 * Need both of these locks, e_lock to protect the device and
+	 * the vnode table, and vn_countlock for the reference count.
 	 */
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 	spinlock_acquire(&ev->ev_v.vn_countlock);
 
@@ -488,7 +486,6 @@ emufs_reclaim(struct vnode *v)
 
 		spinlock_release(&ev->ev_v.vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return EBUSY;
 	}
 	KASSERT(ev->ev_v.vn_refcount == 1);
@@ -503,31 +500,18 @@ emufs_reclaim(struct vnode *v)
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return result;
 	}
 
-	num = vnodearray_num(ef->ef_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *vx;
-
-		vx = vnodearray_get(ef->ef_vnodes, i);
-		if (vx == v) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
+	if (ihash_get(ef->ef_vnodes, ev->ev_handle) != ev) {
 		panic("emu%d: reclaim vnode %u not in vnode pool\n",
 		      ef->ef_emu->e_unit, ev->ev_handle);
 	}
 
-	vnodearray_remove(ef->ef_vnodes, ix);
+	ihash_remove(ef->ef_vnodes, ev->ev_handle);
 	vnode_cleanup(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	kfree(ev);
 	return 0;
@@ -1145,28 +1129,20 @@ int
 emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		struct emufs_vnode **ret)
 {
-	struct vnode *v;
 	struct emufs_vnode *ev;
-	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	num = vnodearray_num(ef->ef_vnodes);
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(ef->ef_vnodes, i);
-		ev = v->vn_data;
-		if (ev->ev_handle == handle) {
-			/* Found */
+	ev = ihash_get(ef->ef_vnodes, handle);
+	if (ev != NULL) {
+		/* Found */
 
-			VOP_INCREF(&ev->ev_v);
+		VOP_INCREF(&ev->ev_v);
 
-			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
-			*ret = ev;
-			return 0;
-		}
+		lock_release(ef->ef_emu->e_lock);
+		*ret = ev;
+		return 0;
 	}
 
 	/* Didn't have one; create it */
@@ -1184,23 +1160,20 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			    &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
 
-	result = vnodearray_add(ef->ef_vnodes, &ev->ev_v, NULL);
+	result = ihash_add(ef->ef_vnodes, handle, ev);
 	if (result) {
 		/* note: vnode_cleanup undoes vnode_init - it does not kfree */
 		vnode_cleanup(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
@@ -1304,7 +1277,7 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
-	ef->ef_vnodes = vnodearray_create();
+	ef->ef_vnodes = ihash_create();
 	if (ef->ef_vnodes == NULL) {
 		kfree(ef);
 		return ENOMEM;
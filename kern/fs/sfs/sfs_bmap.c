@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -43,31 +44,23 @@
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated. The vnode must be locked.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	uint32_t *idbuf;
 	daddr_t block;
 	daddr_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(idbuf[0]) == SFS_BLOCKSIZE);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -154,23 +147,28 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		/* (sfs_balloc zeroed it, in the buffer cache.) */
 	}
 
-	/* Get the block out of the indirect block buffer */
+	/*
+	 * Get the block number out of the indirect block, which is
+	 * (usually) in the buffer cache.
+	 */
+	result = sfs_buf_get(sfs, idblock, true, &buf);
+	if (result) {
+		return result;
+	}
+	idbuf = sfs_buf_data(buf);
 	block = idbuf[idoff];
+	sfs_buf_release(buf, false);
 
-	/* If there's no block there, allocate one */
+	/*
+	 * If there's no block there, allocate one. Don't hang on to
+	 * the indirect block while doing it; sfs_balloc needs a
+	 * buffer too, and holding two at once could deadlock if
+	 * they're all in use. Since we hold the vnode lock, nobody
+	 * can change the indirect block meanwhile.
+	 */
 	if (block==0 && doalloc) {
 		result = sfs_balloc(sfs, &block);
 		if (result) {
@@ -178,13 +176,17 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_buf_get(sfs, idblock, true, &buf);
 		if (result) {
+			sfs_bfree(sfs, block);
 			return result;
 		}
+		idbuf = sfs_buf_data(buf);
+		KASSERT(idbuf[idoff] == 0);
+		idbuf[idoff] = block;
+
+		/* The indirect block is now dirty */
+		sfs_buf_release(buf, true);
 	}
 
 	/* Hand back the result and return. */
@@ -198,21 +200,14 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	uint32_t *idbuf;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
@@ -223,9 +218,7 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -252,12 +245,12 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	if (blocklen < highblock && idblock != 0) {
 		/* We're past the proposed EOF; may need to free stuff */
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		/* Get the indirect block */
+		result = sfs_buf_get(sfs, idblock, true, &buf);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+		idbuf = sfs_buf_data(buf);
 
 		hasnonzero = 0;
 		iddirty = 0;
@@ -274,21 +267,15 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 			}
 		}
 
+		/* If we changed it, it needs writing back */
+		sfs_buf_release(buf, iddirty);
+
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -297,7 +284,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
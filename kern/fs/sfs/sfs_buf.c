@@ -0,0 +1,584 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Block buffer cache.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <coremap.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * One cache is shared by all mounted SFS volumes. Buffers are named
+ * by (device, block) and found through a hash table; the ones nobody
+ * is using are kept on an LRU list and recycled from its head.
+ *
+ * Writes are write-back: a dirty buffer goes to disk when it is
+ * evicted or when its volume is synced.
+ *
+ * buf_lock covers the hash table, the LRU list, and the bookkeeping
+ * fields of every buffer. The data in a buffer is not covered by it;
+ * the caller is expected to hold whatever lock covers the object the
+ * block belongs to. A buffer is busy while it is being read or
+ * written; anyone else who wants it waits on buf_cv, which is also
+ * signalled when a buffer becomes free for reuse.
+ *
+ * The number of buffers is set from the amount of free memory when
+ * a volume is mounted (it can grow, but never shrinks). Buffers are
+ * allocated as they are first needed.
+ */
+
+#define SFS_BUF_NHASH		256	/* hash buckets (power of 2) */
+#define SFS_BUF_MEMFRACTION	8	/* use 1/8 of free memory */
+#define SFS_BUF_MIN		16	/* but at least this many */
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* volume, for doing I/O */
+	struct device *b_dev;		/* key: device */
+	daddr_t b_block;		/* key: block number */
+	void *b_data;			/* SFS_BLOCKSIZE bytes */
+	unsigned b_refcount;		/* users */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data needs writing */
+	bool b_busy;			/* I/O in progress */
+	struct sfs_buf *b_hashnext;	/* hash chain */
+	struct sfs_buf *b_lruprev;	/* LRU list (when unused) */
+	struct sfs_buf *b_lrunext;
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+static struct sfs_buf *buf_hash[SFS_BUF_NHASH];
+static struct sfs_buf *buf_lruhead;	/* least recently used */
+static struct sfs_buf *buf_lrutail;	/* most recently used */
+static struct sfs_buf **buf_all;	/* every buffer allocated */
+static unsigned buf_num;		/* ...how many there are */
+static unsigned buf_max;		/* ...how many there may be */
+
+static struct {
+	unsigned hits;
+	unsigned misses;
+	unsigned evictions;
+	unsigned writebacks;	/* dirty blocks written */
+	unsigned reads;		/* blocks read from disk */
+} buf_stats;
+
+static
+unsigned
+sfs_buf_hashfn(struct device *dev, daddr_t block)
+{
+	return ((uintptr_t)dev / sizeof(void *) + block) % SFS_BUF_NHASH;
+}
+
+static
+struct sfs_buf *
+sfs_buf_lookup(struct device *dev, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	b = buf_hash[sfs_buf_hashfn(dev, block)];
+	while (b != NULL && (b->b_dev != dev || b->b_block != block)) {
+		b = b->b_hashnext;
+	}
+	return b;
+}
+
+static
+void
+sfs_buf_unhash(struct sfs_buf *b)
+{
+	struct sfs_buf **bp;
+
+	bp = &buf_hash[sfs_buf_hashfn(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_dev = NULL;
+	b->b_fs = NULL;
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(buf_lruhead == b);
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(buf_lrutail == b);
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+sfs_buf_lruadd(struct sfs_buf *b)
+{
+	b->b_lruprev = buf_lrutail;
+	b->b_lrunext = NULL;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/*
+ * Write out a dirty buffer. The caller must have a reference to it
+ * (so it can't be recycled) and hold buf_lock, which is released
+ * during the I/O. If someone dirties it again meanwhile it stays
+ * dirty.
+ */
+static
+int
+sfs_buf_writeback(struct sfs_buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_refcount > 0);
+	KASSERT(b->b_dirty && !b->b_busy);
+
+	b->b_busy = true;
+	b->b_dirty = false;
+	lock_release(buf_lock);
+
+	result = sfs_rawblockio(b->b_fs, b->b_block, b->b_data, UIO_WRITE);
+
+	lock_acquire(buf_lock);
+	b->b_busy = false;
+	if (result) {
+		b->b_dirty = true;
+	}
+	else {
+		buf_stats.writebacks++;
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	return result;
+}
+
+/*
+ * Find a buffer to hold a new block: a fresh one if we're under the
+ * limit, else the least recently used clean one. A dirty one is
+ * written out first, after which the caller has to look again, as
+ * the world may have changed; this is signalled by returning NULL.
+ * If the write fails the buffer is left dirty and the oldest clean
+ * one is taken instead.
+ * If every buffer is in use, waits for one and returns NULL.
+ */
+static
+struct sfs_buf *
+sfs_buf_getfree(void)
+{
+	struct sfs_buf *b;
+	int result;
+
+	if (buf_num < buf_max) {
+		b = kmalloc(sizeof(*b));
+		if (b != NULL) {
+			b->b_data = kmalloc(SFS_BLOCKSIZE);
+			if (b->b_data == NULL) {
+				kfree(b);
+				b = NULL;
+			}
+		}
+		if (b != NULL) {
+			b->b_fs = NULL;
+			b->b_dev = NULL;
+			b->b_block = 0;
+			b->b_refcount = 0;
+			b->b_valid = false;
+			b->b_dirty = false;
+			b->b_busy = false;
+			b->b_hashnext = NULL;
+			b->b_lruprev = b->b_lrunext = NULL;
+			buf_all[buf_num++] = b;
+			return b;
+		}
+		/* Out of memory; fall back to recycling one. */
+	}
+
+	b = buf_lruhead;
+	if (b == NULL) {
+		cv_wait(buf_cv, buf_lock);
+		return NULL;
+	}
+	KASSERT(b->b_refcount == 0 && !b->b_busy);
+	if (b->b_dirty) {
+		b->b_refcount++;
+		sfs_buf_lruremove(b);
+		result = sfs_buf_writeback(b);
+		if (result) {
+			kprintf("sfs: %s: block %u: writeback failed: %s\n",
+				b->b_fs->sfs_sb.sb_volname, b->b_block,
+				strerror(result));
+		}
+		b->b_refcount--;
+		if (b->b_refcount == 0) {
+			sfs_buf_lruadd(b);
+		}
+		if (result == 0) {
+			return NULL;
+		}
+
+		/* It stays dirty; take the oldest clean one instead. */
+		b = buf_lruhead;
+		while (b != NULL && b->b_dirty) {
+			b = b->b_lrunext;
+		}
+		if (b == NULL) {
+			return NULL;
+		}
+	}
+
+	sfs_buf_lruremove(b);
+	if (b->b_dev != NULL) {
+		sfs_buf_unhash(b);
+		buf_stats.evictions++;
+	}
+	b->b_valid = false;
+	return b;
+}
+
+/*
+ * Get the buffer for block BLOCK of SFS, with a reference to it.
+ * If FILL is true, its contents are read in if they aren't cached;
+ * otherwise the caller promises to overwrite the whole block (and
+ * may find whatever was there before).
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool fill,
+	    struct sfs_buf **ret)
+{
+	struct device *dev = sfs->sfs_device;
+	struct sfs_buf *b;
+	unsigned h;
+	int result;
+
+	KASSERT(buf_lock != NULL);
+
+	lock_acquire(buf_lock);
+	while (1) {
+		b = sfs_buf_lookup(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			if (b->b_refcount == 0) {
+				sfs_buf_lruremove(b);
+			}
+			b->b_refcount++;
+			if (b->b_valid) {
+				buf_stats.hits++;
+			}
+			else {
+				buf_stats.misses++;
+			}
+			break;
+		}
+
+		b = sfs_buf_getfree();
+		if (b != NULL) {
+			b->b_fs = sfs;
+			b->b_dev = dev;
+			b->b_block = block;
+			h = sfs_buf_hashfn(dev, block);
+			b->b_hashnext = buf_hash[h];
+			buf_hash[h] = b;
+			b->b_refcount = 1;
+			buf_stats.misses++;
+			break;
+		}
+	}
+
+	if (!b->b_valid) {
+		if (fill) {
+			b->b_busy = true;
+			lock_release(buf_lock);
+			result = sfs_rawblockio(sfs, block, b->b_data,
+						UIO_READ);
+			lock_acquire(buf_lock);
+			b->b_busy = false;
+			cv_broadcast(buf_cv, buf_lock);
+			if (result) {
+				/* Leave it invalid; someone may retry. */
+				lock_release(buf_lock);
+				sfs_buf_release(b, false);
+				return result;
+			}
+			buf_stats.reads++;
+		}
+		b->b_valid = true;
+	}
+	lock_release(buf_lock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * The data in a buffer.
+ */
+void *
+sfs_buf_data(struct sfs_buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_data;
+}
+
+/*
+ * Drop a reference to a buffer, marking it dirty if DIRTY is set.
+ */
+void
+sfs_buf_release(struct sfs_buf *b, bool dirty)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_refcount > 0);
+	if (dirty) {
+		KASSERT(b->b_valid);
+		b->b_dirty = true;
+	}
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		sfs_buf_lruadd(b);
+		cv_broadcast(buf_cv, buf_lock);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Drop a reference to a buffer whose contents are garbage (e.g. a
+ * write into it failed partway), so it gets read in again next time.
+ */
+void
+sfs_buf_discard(struct sfs_buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_refcount > 0);
+	b->b_valid = false;
+	b->b_dirty = false;
+	lock_release(buf_lock);
+	sfs_buf_release(b, false);
+}
+
+/*
+ * Write back every dirty buffer of SFS. Buffers that are busy are
+ * waited for, so that everything dirtied before the call is on disk
+ * when it returns.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	struct device *dev = sfs->sfs_device;
+	struct sfs_buf *b;
+	unsigned i;
+	int result, ret = 0;
+
+	lock_acquire(buf_lock);
+	/* buf_all only grows, and never moves while we hold the lock. */
+	for (i=0; i<buf_num; i++) {
+		b = buf_all[i];
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			i--;
+			continue;
+		}
+		if (!b->b_dirty) {
+			continue;
+		}
+		if (b->b_refcount == 0) {
+			sfs_buf_lruremove(b);
+		}
+		b->b_refcount++;
+		result = sfs_buf_writeback(b);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		b->b_refcount--;
+		if (b->b_refcount == 0) {
+			sfs_buf_lruadd(b);
+		}
+	}
+	lock_release(buf_lock);
+	return ret;
+}
+
+/*
+ * Drop all buffers of SFS at unmount. They should all be clean and
+ * unused.
+ */
+void
+sfs_buf_invalidate(struct sfs_fs *sfs)
+{
+	struct device *dev = sfs->sfs_device;
+	struct sfs_buf *b;
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<buf_num; i++) {
+		b = buf_all[i];
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(b->b_refcount == 0 && !b->b_busy && !b->b_dirty);
+		sfs_buf_unhash(b);
+		b->b_valid = false;
+		/* Move it to the head of the LRU list to be reused first. */
+		sfs_buf_lruremove(b);
+		b->b_lrunext = buf_lruhead;
+		if (buf_lruhead != NULL) {
+			buf_lruhead->b_lruprev = b;
+		}
+		else {
+			buf_lrutail = b;
+		}
+		buf_lruhead = b;
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Set up the cache, or grow it, when a volume is mounted: allow it
+ * a fraction of the memory that is free now.
+ */
+int
+sfs_buf_mount(void)
+{
+	struct sfs_buf **newall;
+	unsigned max;
+
+	max = coremap_nfree() / SFS_BUF_MEMFRACTION
+		* (PAGE_SIZE / SFS_BLOCKSIZE);
+	if (max < SFS_BUF_MIN) {
+		max = SFS_BUF_MIN;
+	}
+
+	if (buf_lock == NULL) {
+		buf_lock = lock_create("sfs_buf");
+		if (buf_lock == NULL) {
+			return ENOMEM;
+		}
+		buf_cv = cv_create("sfs_buf");
+		if (buf_cv == NULL) {
+			lock_destroy(buf_lock);
+			buf_lock = NULL;
+			return ENOMEM;
+		}
+	}
+
+	lock_acquire(buf_lock);
+	if (max > buf_max) {
+		newall = kmalloc(max * sizeof(newall[0]));
+		if (newall == NULL) {
+			lock_release(buf_lock);
+			/* Can still run with the buffers we have. */
+			return buf_max > 0 ? 0 : ENOMEM;
+		}
+		if (buf_num > 0) {
+			memcpy(newall, buf_all, buf_num * sizeof(newall[0]));
+		}
+		kfree(buf_all);
+		buf_all = newall;
+		buf_max = max;
+	}
+	lock_release(buf_lock);
+	return 0;
+}
+
+/*
+ * Print/reset the statistics (the bufstat menu command).
+ */
+void
+sfs_buf_printstats(void)
+{
+	unsigned i, inuse = 0, dirty = 0, lookups;
+
+	if (buf_lock == NULL) {
+		kprintf("sfs buffer cache: no volumes mounted yet\n");
+		return;
+	}
+
+	lock_acquire(buf_lock);
+	for (i=0; i<buf_num; i++) {
+		if (buf_all[i]->b_refcount > 0) {
+			inuse++;
+		}
+		if (buf_all[i]->b_dirty) {
+			dirty++;
+		}
+	}
+	lookups = buf_stats.hits + buf_stats.misses;
+
+	kprintf("sfs buffer cache: %u of %u buffers allocated, "
+		"%u in use, %u dirty\n", buf_num, buf_max, inuse, dirty);
+	kprintf("%u lookups: %u hits", lookups, buf_stats.hits);
+	if (lookups > 0) {
+		kprintf(" (%u%%)", buf_stats.hits * 100 / lookups);
+	}
+	kprintf(", %u misses\n", buf_stats.misses);
+	kprintf("%u blocks read, %u written back, %u evictions\n",
+		buf_stats.reads, buf_stats.writebacks, buf_stats.evictions);
+	lock_release(buf_lock);
+}
+
+void
+sfs_buf_resetstats(void)
+{
+	if (buf_lock == NULL) {
+		return;
+	}
+	lock_acquire(buf_lock);
+	bzero(&buf_stats, sizeof(buf_stats));
+	lock_release(buf_lock);
+}
@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -62,8 +63,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,33 +101,58 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read or write a block straight to or from the disk. This is for
+ * the buffer cache; everyone else should go through the cache.
  */
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_rawblockio(struct sfs_fs *sfs, daddr_t block, void *data,
+	       enum uio_rw rw)
 {
 	struct iovec iov;
 	struct uio ku;
 
+	SFSUIO(&iov, &ku, data, block, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Read a block (through the buffer cache).
+ */
+int
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_buf *buf;
+	int result;
+
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_release(buf, false);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block (into the buffer cache; it goes to disk later).
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_buf_data(buf), data, SFS_BLOCKSIZE);
+	sfs_buf_release(buf, true);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,16 +174,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -168,9 +184,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -184,40 +198,28 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache and do the requested
+	 * operation right in the cache buffer. The rest of the block
+	 * has to be read in even when writing, so we don't clobber it.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
 
-	/*
-	 * If it was a write, write back the modified block.
-	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
-	}
+	result = uiomove((char *)sfs_buf_data(buf) + skipstart, len, uio);
 
-	return 0;
+	/* If it was a write, the block needs writing back (even if
+	 * uiomove only got partway, as part of it has changed). */
+	sfs_buf_release(buf, uio->uio_rw == UIO_WRITE);
+	return result;
 }
 
 /*
@@ -228,14 +230,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -258,30 +257,23 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache, so that this sees (and
+	 * replaces) any copy of the block that's there. When writing,
+	 * we overwrite the whole block, so don't bother reading it.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = sfs_buf_get(sfs, diskblock, uio->uio_rw == UIO_READ, &buf);
+	if (result) {
+		return result;
+	}
 
+	result = uiomove(sfs_buf_data(buf), SFS_BLOCKSIZE, uio);
+	if (result && uio->uio_rw == UIO_WRITE) {
+		/* Only part of it got copied in. */
+		sfs_buf_discard(buf);
+		return result;
+	}
+	sfs_buf_release(buf, uio->uio_rw == UIO_WRITE);
 	return result;
 }
 
@@ -296,6 +288,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	origresid = uio->uio_resid;
 
 	/*
@@ -407,6 +401,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	char *blockdata;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,17 +410,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,26 +432,22 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
+	blockdata = sfs_buf_data(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, blockdata + blockoffset, len);
+		sfs_buf_release(buf, false);
 	}
 	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* Update the selected region; it gets written back later */
+		memcpy(blockdata + blockoffset, data, len);
+		sfs_buf_release(buf, true);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
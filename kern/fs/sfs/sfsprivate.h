@@ -32,6 +32,34 @@
 
 #include <uio.h> /* for uio_rw */
 
+/*
+ * Locking.
+ *
+ * There is no lock over the whole volume. SFS's locks, in the order
+ * they must be taken, are:
+ *
+ *    1. sv_lock of a directory       (directory contents and inode)
+ *    2. sfs_vnlock                   (the table of loaded vnodes)
+ *    3. sv_lock of a file            (file contents and inode)
+ *    4. sfs_freemaplock              (free block bitmap, superblock)
+ *    5. the buffer cache's lock      (internal to sfs_buf.c)
+ *
+ * The VFS name cache's lock is a spinlock below all of these.
+ *
+ * All directory entries live in the root directory, so its lock
+ * serializes all name operations on the volume. Link counts change
+ * under the directory lock and the file's lock both.
+ *
+ * sfs_reclaim holds sfs_vnlock while it decides to get rid of a
+ * vnode and writes it out, so sfs_loadvnode can't find it or load a
+ * stale copy of it meanwhile. It locks the vnode under sfs_vnlock
+ * even if it's a directory; nobody else has a reference to it, so
+ * nobody can be holding that lock. Because of that, anything else
+ * that holds sfs_vnlock must not wait for a vnode lock;
+ * sfs_sync_vnodes takes references to the vnodes and lets go of the
+ * table before locking them.
+ */
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
@@ -47,6 +75,17 @@ int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/* Functions in sfs_buf.c */
+struct sfs_buf;
+int sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool fill,
+		struct sfs_buf **ret);
+void *sfs_buf_data(struct sfs_buf *buf);
+void sfs_buf_release(struct sfs_buf *buf, bool dirty);
+void sfs_buf_discard(struct sfs_buf *buf);
+int sfs_buf_sync(struct sfs_fs *sfs);
+void sfs_buf_invalidate(struct sfs_fs *sfs);
+int sfs_buf_mount(void);
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
@@ -71,6 +110,8 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_rawblockio(struct sfs_fs *sfs, daddr_t block, void *data,
+		enum uio_rw rw);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
@@ -51,12 +51,10 @@ struct vnode;
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
-        paddr_t as_pbase1;
         size_t as_npages1;
         vaddr_t as_vbase2;
-        paddr_t as_pbase2;
         size_t as_npages2;
-        paddr_t as_stackpbase;
+        uint32_t **as_ptdir;            /* page table (see dumbvm.c) */
 #else
         /* Put stuff here for your VM system */
 #endif
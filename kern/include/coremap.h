@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+struct addrspace;
+
+/*
+ * Physical memory allocator.
+ *
+ * The coremap has one entry per physical page frame and hands out
+ * frames, singly or in contiguous runs, to the VM system and the
+ * kernel heap.
+ *
+ * coremap_bootstrap takes over physical memory from ram.c; before it
+ * is called, coremap_alloc steals memory with ram_stealmem, and such
+ * memory is never given back. coremap_free takes the address of the
+ * first frame of an allocation and frees the whole allocation.
+ * coremap_alloc returns 0 if it is out of memory.
+ *
+ * Allocations are reference counted so pages can be shared:
+ * coremap_share adds a reference, and coremap_free drops one and only
+ * frees the allocation (and returns true) when the last one goes.
+ */
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned npages);
+bool coremap_free(paddr_t pa);
+void coremap_share(paddr_t pa);
+unsigned coremap_refcount(paddr_t pa);
+
+/*
+ * Page replacement. A pageable user page has an owner, the address
+ * space and virtual address it is mapped at: coremap_setowner sets
+ * it (or with a NULL address space, makes the page not pageable),
+ * and coremap_disown clears it if it's the given address space.
+ * coremap_touch sets the page's reference bit. coremap_victim picks
+ * a pageable page with the clock algorithm and takes it out of the
+ * running; it returns false if there is none.
+ */
+void coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr);
+void coremap_disown(paddr_t pa, struct addrspace *as);
+void coremap_touch(paddr_t pa);
+bool coremap_victim(paddr_t *pa, struct addrspace **as, vaddr_t *vaddr);
+unsigned coremap_nfree(void);
+
+/*
+ * A slot per page for the kernel heap, so kfree can go straight from
+ * a block to the heap page it's on: coremap_setkheap stores DATA for
+ * the page at PA and coremap_getkheap returns it (NULL if unset).
+ */
+void coremap_setkheap(paddr_t pa, void *data);
+void *coremap_getkheap(paddr_t pa);
+
+/* Print counts of free and used frames. */
+void coremap_printstats(void);
+
+#endif /* _COREMAP_H_ */
@@ -35,6 +35,12 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/*
+ * Number of scheduler priority levels. Each cpu has one run queue per
+ * level; level 0 is the highest priority. See schedule() in thread.c.
+ */
+#define SCHED_NLEVELS	4
+
 
 /*
  * Per-cpu structure
@@ -59,7 +65,8 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
-	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_hardclocks;		/* Counter of hardclock() calls (peeked
+				   at by thread_steal on other cpus) */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
 	/*
@@ -67,7 +74,7 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues by priority */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -155,6 +162,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch sends up to TLBSHOOTDOWN_MAX shootdowns to
+ * one CPU with a single IPI.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +178,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_batch(struct cpu *target,
+			   const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
@@ -37,6 +37,8 @@
 #include <fs.h>
 #include <vnode.h>
 
+struct ihash;
+
 /*
  * Our structures
  */
@@ -51,7 +53,7 @@ struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
-	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+	struct ihash *ef_vnodes;	/* loaded vnodes, by handle */
 };
 
 
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _IHASH_H_
+#define _IHASH_H_
+
+/*
+ * Hash table mapping 32-bit integer keys (inode numbers and the like)
+ * to non-NULL pointers. Grows and shrinks as needed. No internal
+ * locking; the caller provides that.
+ *
+ * Functions:
+ *     ihash_create  - allocate a new table. Returns NULL on error.
+ *     ihash_num     - return the number of entries.
+ *     ihash_get     - return the value stored under KEY, or NULL.
+ *     ihash_add     - store VAL under KEY, which must not be present
+ *                     already. May fail and return ENOMEM.
+ *     ihash_remove  - remove KEY, which must be present.
+ *     ihash_iterate - return the next value at or after *POS and
+ *                     advance *POS past it, or NULL at the end. Start
+ *                     with *POS = 0. Don't add or remove meanwhile.
+ *     ihash_destroy - destroy a table, which must be empty.
+ */
+
+struct ihash;  /* Opaque. */
+
+struct ihash *ihash_create(void);
+unsigned      ihash_num(const struct ihash *);
+void         *ihash_get(const struct ihash *, uint32_t key);
+int           ihash_add(struct ihash *, uint32_t key, void *val);
+void          ihash_remove(struct ihash *, uint32_t key);
+void         *ihash_iterate(const struct ihash *, unsigned *pos);
+void          ihash_destroy(struct ihash *);
+
+
+#endif /* _IHASH_H_ */
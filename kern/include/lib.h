@@ -125,6 +125,9 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_setmagazines turns the per-cpu caches in front of the
+ * subpage allocator on and off; it exists for benchmarking.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +135,24 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_setmagazines(bool on);
+
+/*
+ * Object caches, for fixed-size objects that are created and
+ * destroyed often. kmem_cache_create makes a cache of objects of the
+ * given size; CTOR, if not NULL, is run on each object when the cache
+ * first gets memory for it (returning an error code), and DTOR when
+ * that memory is given back. Objects must be returned to
+ * kmem_cache_free in the constructed state. kmem_cache_alloc returns
+ * NULL if out of memory.
+ */
+struct kmem_cache;
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_printstats(void);
 
 /*
  * C string functions.
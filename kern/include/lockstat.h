@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics. Enable with "options lockstat" in the
+ * kernel config; without it all of this compiles away.
+ *
+ * Each spinlock, lock, and semaphore carries a hook that points at a
+ * record in a fixed table in lockstat.c, assigned the first time it is
+ * acquired. The records live in that
+ * table, not in the primitive, so they survive the primitive being
+ * destroyed (and its stats can still be printed afterwards) and a
+ * primitive that is freed without being cleaned up leaves nothing
+ * dangling. If the table fills up, further primitives all share one
+ * overflow record.
+ *
+ * Times come from gettime() and are only collected after
+ * lockstat_bootstrap(), once the clock exists.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+struct lockstat;	/* Opaque */
+
+struct lockstat_hook {
+	struct lockstat *lh_stat;	/* record, or NULL if none yet */
+	uint64_t lh_acquired;		/* when the holder got it (ns) */
+};
+
+/*
+ * Functions.
+ *
+ * lockstat_bootstrap	Start collecting. Call once the clock is up.
+ *
+ * lockstat_now		Current time in nanoseconds, or 0 if not
+ *			collecting.
+ *
+ * lockstat_init	Initialize a hook. No record is assigned until
+ *			the first acquisition.
+ * lockstat_cleanup	Detach a hook. The record is kept until reset.
+ *
+ * lockstat_acquired	Count an acquisition. KIND (a string constant)
+ *			and NAME (copied; may be NULL) label the record
+ *			if this is the first one. WAITSTART is when the
+ *			caller first found the primitive busy, or 0 if
+ *			it did not have to wait.
+ * lockstat_released	Count the time held since lockstat_acquired.
+ *
+ * lockstat_print	Print the N records with the most wait time.
+ * lockstat_reset	Zero all records and drop those whose
+ *			primitive has been destroyed.
+ *
+ * lockstat_acquired and lockstat_released must be called while the
+ * caller has exclusive use of the primitive, e.g. with its spinlock
+ * held, as they update the record without further locking.
+ */
+void lockstat_bootstrap(void);
+uint64_t lockstat_now(void);
+void lockstat_init(struct lockstat_hook *h);
+void lockstat_cleanup(struct lockstat_hook *h);
+void lockstat_acquired(struct lockstat_hook *h, const char *kind,
+		       const char *name, uint64_t waitstart);
+void lockstat_released(struct lockstat_hook *h);
+void lockstat_print(unsigned n);
+void lockstat_reset(void);
+
+#define LOCKSTAT_HOOK(sym)	struct lockstat_hook sym
+
+/* Includes its trailing comma; see SPINLOCK_INITIALIZER. */
+#define LOCKSTAT_HOOK_INITIALIZER	{ NULL, 0 },
+
+#else
+
+#define LOCKSTAT_HOOK(sym)
+
+#define LOCKSTAT_HOOK_INITIALIZER
+
+#endif
+
+#endif /* _LOCKSTAT_H_ */
@@ -42,6 +42,9 @@
 #include <fs.h>
 #include <vnode.h>
 
+struct ihash;
+struct lock;
+
 /*
  * Get on-disk structures and constants that are made available to
  * userland for the benefit of mksfs, dumpsfs, etc.
@@ -50,25 +53,35 @@
 
 /*
  * In-memory inode
+ *
+ * sv_lock covers sv_i, sv_dirty, and the contents of the file's
+ * blocks (data, indirect, and directory entries). sv_ino is fixed.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* per-vnode lock */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * sfs_vnlock covers the vnode table. sfs_freemaplock covers the
+ * freemap and the superblock's dirty flag. The rest is fixed while
+ * the volume is mounted. (See sfsprivate.h for the lock order.)
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct ihash *sfs_vnodes;       /* loaded vnodes, by inode number */
+	struct lock *sfs_vnlock;        /* vnode table lock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_freemaplock;   /* freemap/superblock lock */
 };
 
 /*
@@ -76,5 +89,11 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print/reset buffer cache statistics (the bufstat menu command)
+ */
+void sfs_buf_printstats(void);
+void sfs_buf_resetstats(void);
+
 
 #endif /* _SFS_H_ */
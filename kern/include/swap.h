@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted from memory are kept in page-sized slots on a raw
+ * disk, SWAP_DEVICE. swap_bootstrap opens it; if there is no such
+ * disk, swapping is just turned off and swap_enabled returns false.
+ *
+ * Like coremap frames, slots are reference counted so a page that
+ * is shared copy-on-write can also be swapped out while shared:
+ * swap_alloc hands out one reference, swap_share adds one, and
+ * swap_release drops one and frees the slot when none are left.
+ *
+ * swap_in and swap_out move one page between a slot and a physical
+ * frame. They sleep for the I/O.
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+void swap_bootstrap(void);
+bool swap_enabled(void);
+
+int swap_alloc(unsigned *slot);
+void swap_share(unsigned slot);
+void swap_release(unsigned slot);
+
+int swap_in(unsigned slot, paddr_t pa);
+int swap_out(paddr_t pa, unsigned slot);
+
+/* Print how much swap is in use. */
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
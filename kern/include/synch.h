@@ -48,6 +48,7 @@ struct semaphore {
         struct wchan *sem_wchan;
         struct spinlock sem_lock;
         volatile unsigned sem_count;
+        LOCKSTAT_HOOK(sem_lockstat);    /* Contention statistics. */
 };
 
 struct semaphore *sem_create(const char *name, unsigned initial_count);
@@ -71,6 +72,12 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * A lock made with lock_create_adaptive spins instead of sleeping
+ * while the thread holding it is running on another CPU, and only
+ * sleeps once the holder is not running. This is worth it for locks
+ * held over very short critical sections, where the holder will
+ * usually let go sooner than a context switch would take.
  */
 struct lock {
         char *lk_name;
@@ -78,9 +85,14 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+        unsigned lk_setwaiters;         /* lock_acquire_set callers
+                                           waiting on this lock */
+        bool lk_adaptive;               /* spin while holder runs */
+        LOCKSTAT_HOOK(lk_lockstat);     /* Contention statistics. */
 };
 
 struct lock *lock_create(const char *name);
+struct lock *lock_create_adaptive(const char *name);
 void lock_destroy(struct lock *);
 
 /*
@@ -98,6 +110,21 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Operations on sets of locks:
+ *    lock_acquire_set - Get all N locks in LOCKS at once. If any of them
+ *                   is held, hold none of them and sleep until all are
+ *                   free, so a thread never holds part of the set while
+ *                   waiting for the rest. The locks must be distinct.
+ *    lock_release_set - Release all N locks in LOCKS.
+ *
+ * A set may overlap with other sets and with locks taken singly by
+ * lock_acquire. Set waiters share one wait channel and are all woken
+ * whenever a lock any of them is waiting on is released.
+ */
+void lock_acquire_set(struct lock **locks, unsigned n);
+void lock_release_set(struct lock **locks, unsigned n);
+
 
 /*
  * Condition variable.
@@ -140,4 +167,56 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers get preference: once a writer is waiting, new readers wait
+ * behind it, so a steady stream of readers cannot starve writers.
+ * When a writer releases the lock it hands it to the next waiting
+ * writer if there is one, and otherwise lets all waiting readers in.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rw_name;
+        HANGMAN_LOCKABLE(rw_hangman);   /* Deadlock detector hook. */
+        struct spinlock rw_lock;
+        struct wchan *rw_readwchan;     /* readers waiting */
+        struct wchan *rw_writewchan;    /* writers waiting */
+        unsigned rw_readers;            /* readers holding the lock */
+        unsigned rw_writerswaiting;     /* writers waiting for it */
+        struct thread *rw_writer;       /* writer holding the lock */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Blocks while a
+ *                           writer holds the lock or is waiting for it.
+ *    rwlock_release_read  - Free a read hold on the lock.
+ *    rwlock_acquire_write - Get the lock for writing. Blocks until there
+ *                           are no readers and no writer.
+ *    rwlock_release_write - Free the write hold on the lock. Only the
+ *                           thread holding it may do this.
+ *
+ * The deadlock detector sees writers as holding the lock. Readers are
+ * shown as waiting for it while they block, but not as holding it.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+
+
+/*
+ * Set up global state used by the synchronization primitives. Called
+ * once during boot, after the thread system is up.
+ */
+void synch_bootstrap(void);
+
+
 #endif /* _SYNCH_H_ */
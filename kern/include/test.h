@@ -50,14 +50,19 @@ int run_paintshop(int, char **);
 int arraytest(int, char **);
 int arraytest2(int, char **);
 int bitmaptest(int, char **);
+int ihashtest(int, char **);
+int ihashbench(int, char **);
 int threadlisttest(int, char **);
 
 /* thread tests */
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int schedpong(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
+int lockbench(int, char **);
+int rwtest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
 
@@ -92,6 +97,7 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
+int unalignedstress(int, char **);
 int printfile(int, char **);
 
 /* other tests */
@@ -99,6 +105,7 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -83,6 +83,9 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Scheduler level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks when last run */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
 	/*
@@ -158,6 +161,14 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current hardclock tick to the current thread. Returns
+ * true if it should now yield the cpu, because it has used up its
+ * quantum or because a higher-priority thread is waiting. Called from
+ * the timer interrupt.
+ */
+bool thread_charge_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
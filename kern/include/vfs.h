@@ -183,6 +183,46 @@ int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
 int vfs_unmountall(void);
 
+/*
+ * Name cache (vfsdcache.c). vfs_lookup consults it for single-name
+ * lookups; filesystems fill it in and keep it up to date.
+ *
+ *    vfs_dcache_bootstrap - Initialize; called by vfs_bootstrap.
+ *
+ *    vfs_dcache_lookup   - Look up NAME in DIR. Returns false on a
+ *                          miss. On a hit returns true and hands back
+ *                          the vnode, with a reference, or NULL if NAME
+ *                          is known not to exist.
+ *
+ *    vfs_dcache_enter    - Record that NAME in DIR is VN, or doesn't
+ *                          exist if VN is NULL. No reference is kept.
+ *                          Call with DIR locked so NAME can't change.
+ *
+ *    vfs_dcache_purge    - Forget NAME in DIR. Call whenever NAME is
+ *                          created, removed or changed, before
+ *                          unlocking DIR.
+ *
+ *    vfs_dcache_purgevnode - Forget everything about VN. A filesystem
+ *                          that calls vfs_dcache_enter must call this
+ *                          from VOP_RECLAIM, before checking the
+ *                          refcount and at a point where its lookups
+ *                          can't find VN, so that no cache hit can
+ *                          pick up VN once the decision to reclaim it
+ *                          is made.
+ *
+ *    vfs_dcache_printstats - Print hit rates and such.
+ *    vfs_dcache_resetstats - Reset the statistics.
+ */
+
+void vfs_dcache_bootstrap(void);
+bool vfs_dcache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret);
+void vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void vfs_dcache_purge(struct vnode *dir, const char *name);
+void vfs_dcache_purgevnode(struct vnode *vn);
+void vfs_dcache_printstats(void);
+void vfs_dcache_resetstats(void);
+
 /*
  * Array of vnodes.
  */
@@ -193,13 +233,5 @@ int vfs_unmountall(void);
 DECLARRAY(vnode, VFSINLINE);
 DEFARRAY(vnode, VFSINLINE);
 
-/*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
- */
-void vfs_biglock_acquire(void);
-void vfs_biglock_release(void);
-bool vfs_biglock_do_i_hold(void);
-
 
 #endif /* _VFS_H_ */
@@ -58,5 +58,12 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Print/reset VM statistics (the vmstat menu command) */
+void vm_printstats(void);
+void vm_resetstats(void);
+
+/* Idle-loop work (pre-zeroing pages); returns false if there was none */
+bool vm_idle(void);
+
 
 #endif /* _VM_H_ */
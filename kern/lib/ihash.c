@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Hash table of integer keys.
+ *
+ * This uses open addressing with linear probing: entries live
+ * directly in one array of slots, and a key that collides goes in
+ * the next free slot after its home slot. A lookup is a hash and
+ * usually one or two slot compares, with no pointer chasing, and
+ * there's no per-entry allocation. An empty slot has a NULL value.
+ *
+ * The size is always a power of 2 and the table is kept at most 3/4
+ * full, so probe sequences stay short. Removal shifts later entries
+ * in the same run back rather than leaving tombstones, so lookups
+ * don't slow down as entries come and go.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <ihash.h>
+
+#define IHASH_MINSIZE	16
+
+struct ihash_slot {
+	uint32_t key;
+	void *val;
+};
+
+struct ihash {
+	unsigned num;			/* entries in use */
+	unsigned size;			/* slots, power of 2 */
+	unsigned shift;			/* 32 - log2(size) */
+	struct ihash_slot *slots;
+};
+
+/*
+ * Home slot for KEY. Multiplying by 2^32 divided by the golden ratio
+ * and keeping the top bits spreads out runs of consecutive keys, such
+ * as the inode numbers of files created together.
+ */
+static
+inline
+unsigned
+ihash_home(const struct ihash *h, uint32_t key)
+{
+	return (uint32_t)(key * 0x9e3779b1U) >> h->shift;
+}
+
+/*
+ * Return the slot holding KEY, or the empty slot that ends its probe
+ * sequence if KEY isn't there.
+ */
+static
+unsigned
+ihash_find(const struct ihash *h, uint32_t key)
+{
+	unsigned i, mask;
+
+	mask = h->size - 1;
+	i = ihash_home(h, key);
+	while (h->slots[i].val != NULL && h->slots[i].key != key) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+/*
+ * Change the number of slots to NEWSIZE and rehash everything.
+ */
+static
+int
+ihash_resize(struct ihash *h, unsigned newsize)
+{
+	struct ihash_slot *oldslots;
+	unsigned oldsize, i, j, shift;
+
+	KASSERT((newsize & (newsize - 1)) == 0);
+	KASSERT(newsize >= IHASH_MINSIZE);
+	KASSERT(h->num < newsize);
+
+	shift = 32;
+	for (i = newsize; i > 1; i >>= 1) {
+		shift--;
+	}
+
+	oldslots = h->slots;
+	oldsize = h->size;
+
+	h->slots = kmalloc(newsize * sizeof(struct ihash_slot));
+	if (h->slots == NULL) {
+		h->slots = oldslots;
+		return ENOMEM;
+	}
+	for (i=0; i<newsize; i++) {
+		h->slots[i].key = 0;
+		h->slots[i].val = NULL;
+	}
+	h->size = newsize;
+	h->shift = shift;
+
+	for (i=0; i<oldsize; i++) {
+		if (oldslots[i].val != NULL) {
+			j = ihash_find(h, oldslots[i].key);
+			KASSERT(h->slots[j].val == NULL);
+			h->slots[j] = oldslots[i];
+		}
+	}
+	kfree(oldslots);
+	return 0;
+}
+
+struct ihash *
+ihash_create(void)
+{
+	struct ihash *h;
+
+	h = kmalloc(sizeof(*h));
+	if (h == NULL) {
+		return NULL;
+	}
+	h->num = 0;
+	h->size = 0;
+	h->slots = NULL;
+	if (ihash_resize(h, IHASH_MINSIZE)) {
+		kfree(h);
+		return NULL;
+	}
+	return h;
+}
+
+void
+ihash_destroy(struct ihash *h)
+{
+	/* As with arrays, require it to be empty to catch leaks. */
+	KASSERT(h->num == 0);
+	kfree(h->slots);
+	kfree(h);
+}
+
+unsigned
+ihash_num(const struct ihash *h)
+{
+	return h->num;
+}
+
+void *
+ihash_get(const struct ihash *h, uint32_t key)
+{
+	return h->slots[ihash_find(h, key)].val;
+}
+
+int
+ihash_add(struct ihash *h, uint32_t key, void *val)
+{
+	unsigned i;
+	int result;
+
+	KASSERT(val != NULL);
+
+	if ((h->num + 1) * 4 > h->size * 3) {
+		result = ihash_resize(h, h->size * 2);
+		if (result) {
+			return result;
+		}
+	}
+
+	i = ihash_find(h, key);
+	KASSERT(h->slots[i].val == NULL);
+	h->slots[i].key = key;
+	h->slots[i].val = val;
+	h->num++;
+	return 0;
+}
+
+void
+ihash_remove(struct ihash *h, uint32_t key)
+{
+	unsigned i, j, k, mask;
+
+	mask = h->size - 1;
+	i = ihash_find(h, key);
+	KASSERT(h->slots[i].val != NULL);
+
+	/*
+	 * Slot I is now a hole. Walk the rest of the run and move back
+	 * into the hole any entry whose home slot is not between the
+	 * hole and where the entry sits (cyclically), since a lookup
+	 * for it would stop at the hole.
+	 */
+	j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (h->slots[j].val == NULL) {
+			break;
+		}
+		k = ihash_home(h, h->slots[j].key);
+		if (((j - k) & mask) >= ((j - i) & mask)) {
+			h->slots[i] = h->slots[j];
+			i = j;
+		}
+	}
+	h->slots[i].key = 0;
+	h->slots[i].val = NULL;
+	h->num--;
+
+	/* Give back space once it's mostly empty; failing is harmless. */
+	if (h->size > IHASH_MINSIZE && h->num * 8 < h->size) {
+		(void)ihash_resize(h, h->size / 2);
+	}
+}
+
+void *
+ihash_iterate(const struct ihash *h, unsigned *pos)
+{
+	unsigned i;
+
+	for (i = *pos; i < h->size; i++) {
+		if (h->slots[i].val != NULL) {
+			*pos = i + 1;
+			return h->slots[i].val;
+		}
+	}
+	*pos = h->size;
+	return NULL;
+}
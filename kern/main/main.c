@@ -49,6 +49,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <lockstat.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -110,6 +111,7 @@ boot(void)
 	ram_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
+	synch_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
 	kheap_nextgeneration();
@@ -119,6 +121,10 @@ boot(void)
 	KASSERT(curthread->t_curspl > 0);
 	mainbus_bootstrap();
 	KASSERT(curthread->t_curspl == 0);
+#if OPT_LOCKSTAT
+	/* Needs the timer clock, which mainbus_bootstrap just attached. */
+	lockstat_bootstrap();
+#endif
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
@@ -40,11 +40,14 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
+#include <lockstat.h>
 #include <syscall.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 #include <test.h>  // potentially depend on opt-* above 
 
 /*
@@ -495,6 +498,81 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vm_resetstats();
+	}
+	else {
+		kprintf("Usage: vmstat [reset]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_bufstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		sfs_buf_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		sfs_buf_resetstats();
+	}
+	else {
+		kprintf("Usage: bufstat [reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_dcstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vfs_dcache_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vfs_dcache_resetstats();
+	}
+	else {
+		kprintf("Usage: dcstat [reset]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_print(10);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		lockstat_print(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: lockstat [count | reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -556,14 +634,18 @@ static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[at2] Large array test              ",
 	"[bt]  Bitmap test                   ",
+	"[ht]  Integer hash table test       ",
+	"[ht2] Hash table lookup benchmark   ",
 	"[tlt] Threadlist test               ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc throughput test       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Scheduler latency (schedpong) ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -571,6 +653,8 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sy5] Lock contention benchmark     ",
+	"[sy6] RW lock test                  ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -578,6 +662,7 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fs7] FS unaligned I/O stress       ",
 	NULL
 };
 
@@ -606,6 +691,14 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vmstat] VM fault stats             ",
+#if OPT_SFS
+	"[bufstat] SFS buffer cache stats    ",
+#endif
+	"[dcstat] VFS name cache stats       ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -665,28 +758,42 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vmstat",     cmd_vmstat },
+#if OPT_SFS
+	{ "bufstat",    cmd_bufstat },
+#endif
+	{ "dcstat",     cmd_dcstat },
+#if OPT_LOCKSTAT
+	{ "lockstat",   cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "at2",	arraytest2 },
 	{ "bt",		bitmaptest },
+	{ "ht",		ihashtest },
+	{ "ht2",	ihashbench },
 	{ "tlt",	threadlisttest },
 	{ "km1",	kmalloctest },
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	schedpong },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	lockbench },
+	{ "sy6",	rwtest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -719,6 +826,7 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fs7",	unalignedstress },
 
 	{ NULL, NULL }
 };
@@ -37,6 +37,7 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <clock.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -57,8 +58,11 @@ runprogram(char *progname)
 	struct addrspace *as;
 	struct vnode *v;
 	vaddr_t entrypoint, stackptr;
+	struct timespec start, end;
 	int result;
 
+	gettime(&start);
+
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
@@ -90,6 +94,12 @@ runprogram(char *progname)
 	/* Done with the file now. */
 	vfs_close(v);
 
+	/* Report exec latency; with demand paging it's not size-bound. */
+	gettime(&end);
+	timespec_sub(&end, &start, &end);
+	DEBUG(DB_EXEC, "runprogram: loaded in %llu.%09lu seconds\n",
+	      (unsigned long long)end.tv_sec, (unsigned long)end.tv_nsec);
+
 	/* Define the user stack in the address space */
 	result = as_define_stack(as, &stackptr);
 	if (result) {
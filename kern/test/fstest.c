@@ -56,6 +56,7 @@
 #define NTHREADS 12
 #define NLONG    32
 #define NCREATE  24
+#define NUNALIGN 24000	/* bytes per file in the unaligned test */
 
 static struct semaphore *threadsem = NULL;
 
@@ -674,6 +675,156 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Unaligned I/O stress: each thread writes its own file in chunks of
+ * odd sizes, so that almost every chunk starts or ends partway
+ * through a block (and some span several blocks), then reads it back
+ * in chunks of different odd sizes. This exercises the partial-block
+ * path in the filesystem from many threads at once.
+ */
+
+/* Chunk sizes to cycle through; the largest must come last. */
+static const size_t unalign_sizes[] = { 1, 23, 511, 513, 1031, 7, 2053 };
+#define NUNALIGNSIZES (sizeof(unalign_sizes) / sizeof(unalign_sizes[0]))
+
+/* The byte that belongs at offset POS of thread NUM's file. */
+static
+char
+unalign_byte(unsigned long num, off_t pos)
+{
+	return 'A' + (pos * 7 + num) % 26;
+}
+
+static
+int
+unalign_io(struct vnode *vn, const char *name, unsigned long num,
+	   char *buf, enum uio_rw rw, unsigned firstsize)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t pos = 0;
+	size_t len, i;
+	unsigned which = firstsize;
+	int err;
+
+	while (pos < NUNALIGN) {
+		len = unalign_sizes[which++ % NUNALIGNSIZES];
+		if (len > (size_t)(NUNALIGN - pos)) {
+			len = NUNALIGN - pos;
+		}
+		if (rw == UIO_WRITE) {
+			for (i=0; i<len; i++) {
+				buf[i] = unalign_byte(num, pos + i);
+			}
+		}
+		uio_kinit(&iov, &ku, buf, len, pos, rw);
+		err = (rw == UIO_WRITE) ? VOP_WRITE(vn, &ku) : VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("%s: %s error at %lld: %s\n", name,
+				rw == UIO_WRITE ? "Write" : "Read",
+				pos, strerror(err));
+			return -1;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short %s at %lld: %lu bytes left over\n",
+				name, rw == UIO_WRITE ? "write" : "read",
+				pos, (unsigned long) ku.uio_resid);
+			return -1;
+		}
+		if (rw == UIO_READ) {
+			for (i=0; i<len; i++) {
+				if (buf[i] != unalign_byte(num, pos + i)) {
+					kprintf("%s: Test failed: byte %lld "
+						"mismatched\n", name,
+						pos + i);
+					return -1;
+				}
+			}
+		}
+		pos += len;
+	}
+	return 0;
+}
+
+static
+void
+unalignedstress_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	char namesuffix[16];
+	char name[32];
+	char path[32];
+	char *buf;
+	struct vnode *vn;
+	int err;
+
+	snprintf(namesuffix, sizeof(namesuffix), "u%lu", num);
+	MAKENAME();
+
+	buf = kmalloc(unalign_sizes[NUNALIGNSIZES - 1]);
+	if (buf == NULL) {
+		kprintf("*** Thread %lu: out of memory\n", num);
+		V(threadsem);
+		return;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(path, name);
+	err = vfs_open(path, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s: %s\n", name, strerror(err));
+		kprintf("*** Thread %lu: failed\n", num);
+		kfree(buf);
+		V(threadsem);
+		return;
+	}
+
+	if (unalign_io(vn, name, num, buf, UIO_WRITE, num) ||
+	    unalign_io(vn, name, num, buf, UIO_READ, num + 3)) {
+		kprintf("*** Thread %lu: failed\n", num);
+	}
+	else {
+		kprintf("%s: %d bytes written and read\n", name, NUNALIGN);
+	}
+	vfs_close(vn);
+	kfree(buf);
+
+	if (fstest_remove(filesys, namesuffix)) {
+		kprintf("*** Thread %lu: failed\n", num);
+	}
+
+	V(threadsem);
+}
+
+static
+void
+dounalignedstress(const char *filesys)
+{
+	int i, err;
+
+	init_threadsem();
+
+	kprintf("*** Starting fs unaligned I/O stress test on %s:\n",
+		filesys);
+
+	for (i=0; i<NTHREADS; i++) {
+		err = thread_fork("unalignedstress", NULL,
+				  unalignedstress_thread, (char *)filesys, i);
+		if (err) {
+			panic("unalignedstress: thread_fork failed %s\n",
+			      strerror(err));
+		}
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		P(threadsem);
+	}
+
+	kprintf("*** fs unaligned I/O stress test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -681,7 +832,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[123456] filesystem:\n");
+		kprintf("Usage: fs[1234567] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -714,6 +865,7 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(createstress);
+DEFTEST(unalignedstress);
 
 ////////////////////////////////////////////////////////////
 
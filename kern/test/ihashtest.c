@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <array.h>
+#include <clock.h>
+#include <ihash.h>
+#include <test.h>
+
+#define TESTSIZE 1000
+#define TESTKEY(i) ((uint32_t)(i) * 4099 + 17)  /* spread-out keys */
+
+#define BENCHMAX 4096
+#define NBENCHLOOKUPS 20000
+
+struct ihashtest_item {
+	uint32_t key;
+	bool present;
+};
+
+static struct ihashtest_item testitems[TESTSIZE];
+
+/*
+ * Check every item is in the table exactly when it's marked present,
+ * and that iterating finds each present one once.
+ */
+static
+void
+ihashtest_check(struct ihash *h)
+{
+	struct ihashtest_item *item;
+	unsigned i, num, pos;
+
+	num = 0;
+	for (i=0; i<TESTSIZE; i++) {
+		item = ihash_get(h, testitems[i].key);
+		if (testitems[i].present) {
+			KASSERT(item == &testitems[i]);
+			num++;
+		}
+		else {
+			KASSERT(item == NULL);
+		}
+	}
+	KASSERT(ihash_num(h) == num);
+
+	pos = 0;
+	while ((item = ihash_iterate(h, &pos)) != NULL) {
+		KASSERT(item->present);
+		num--;
+	}
+	KASSERT(num == 0);
+}
+
+int
+ihashtest(int nargs, char **args)
+{
+	struct ihash *h;
+	unsigned i, round;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting ihash test...\n");
+
+	for (i=0; i<TESTSIZE; i++) {
+		testitems[i].key = TESTKEY(i);
+		testitems[i].present = false;
+	}
+
+	h = ihash_create();
+	KASSERT(h != NULL);
+	ihashtest_check(h);
+
+	/* Add everything, so the table grows several times. */
+	for (i=0; i<TESTSIZE; i++) {
+		result = ihash_add(h, testitems[i].key, &testitems[i]);
+		KASSERT(result == 0);
+		testitems[i].present = true;
+	}
+	ihashtest_check(h);
+
+	/* Add and remove at random. */
+	for (round=0; round<10; round++) {
+		for (i=0; i<TESTSIZE; i++) {
+			if (random() % 2 == 0) {
+				continue;
+			}
+			if (testitems[i].present) {
+				ihash_remove(h, testitems[i].key);
+				testitems[i].present = false;
+			}
+			else {
+				result = ihash_add(h, testitems[i].key,
+						   &testitems[i]);
+				KASSERT(result == 0);
+				testitems[i].present = true;
+			}
+		}
+		ihashtest_check(h);
+	}
+
+	/* Empty it, so it shrinks again. */
+	for (i=0; i<TESTSIZE; i++) {
+		if (testitems[i].present) {
+			ihash_remove(h, testitems[i].key);
+			testitems[i].present = false;
+		}
+	}
+	ihashtest_check(h);
+
+	ihash_destroy(h);
+
+	kprintf("ihash test complete\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Lookup-rate benchmark: compare ihash_get against the linear array
+ * search the vnode tables used to do, at a few table sizes.
+ */
+
+static struct ihashtest_item benchitems[BENCHMAX];
+
+static
+uint64_t
+ihashbench_rate(const struct timespec *before, const struct timespec *after)
+{
+	struct timespec duration;
+	uint64_t nsecs;
+
+	timespec_sub(after, before, &duration);
+	nsecs = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	if (nsecs == 0) {
+		nsecs = 1;
+	}
+	return (uint64_t)NBENCHLOOKUPS * 1000000000 / nsecs;
+}
+
+static
+void
+ihashbench_run(unsigned n)
+{
+	struct ihash *h;
+	struct array *a;
+	struct ihashtest_item *item;
+	struct timespec before, after;
+	uint64_t hashrate, linearrate;
+	unsigned i, j, num;
+	uint32_t key;
+	int result;
+
+	h = ihash_create();
+	a = array_create();
+	if (h == NULL || a == NULL) {
+		panic("ihashbench: Out of memory\n");
+	}
+	for (i=0; i<n; i++) {
+		benchitems[i].key = TESTKEY(i);
+		result = ihash_add(h, benchitems[i].key, &benchitems[i]);
+		if (result) {
+			panic("ihashbench: ihash_add: %s\n", strerror(result));
+		}
+		result = array_add(a, &benchitems[i], NULL);
+		if (result) {
+			panic("ihashbench: array_add: %s\n", strerror(result));
+		}
+	}
+
+	gettime(&before);
+	for (j=0; j<NBENCHLOOKUPS; j++) {
+		key = benchitems[(j * 7919) % n].key;
+		item = ihash_get(h, key);
+		KASSERT(item != NULL && item->key == key);
+	}
+	gettime(&after);
+	hashrate = ihashbench_rate(&before, &after);
+
+	gettime(&before);
+	for (j=0; j<NBENCHLOOKUPS; j++) {
+		key = benchitems[(j * 7919) % n].key;
+		num = array_num(a);
+		item = NULL;
+		for (i=0; i<num; i++) {
+			item = array_get(a, i);
+			if (item->key == key) {
+				break;
+			}
+		}
+		KASSERT(item != NULL && item->key == key);
+	}
+	gettime(&after);
+	linearrate = ihashbench_rate(&before, &after);
+
+	kprintf("%4u entries: hash %llu lookups/sec, linear %llu lookups/sec\n",
+		n, (unsigned long long)hashrate,
+		(unsigned long long)linearrate);
+
+	for (i=0; i<n; i++) {
+		ihash_remove(h, benchitems[i].key);
+	}
+	ihash_destroy(h);
+	array_setsize(a, 0);
+	array_destroy(a);
+}
+
+int
+ihashbench(int nargs, char **args)
+{
+	unsigned n;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting ihash lookup benchmark...\n");
+	for (n = 16; n <= BENCHMAX; n *= 4) {
+		ihashbench_run(n);
+	}
+	kprintf("ihash lookup benchmark done.\n");
+	return 0;
+}
@@ -33,6 +33,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
@@ -378,3 +379,103 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Multithreaded kmalloc throughput benchmark. Each of NTHREADS
+ * threads repeatedly allocates a small working set of subpage blocks
+ * of assorted sizes and frees it again. This is run once going
+ * straight to the shared subpage pools and once through the per-cpu
+ * magazines, and the allocation rate of each is printed.
+ */
+
+#define KM5_LOOPS	500
+#define KM5_SETSIZE	8
+
+static
+void
+kmalloctest5thread(void *sm, unsigned long num)
+{
+	static const unsigned sizes[KM5_SETSIZE] =
+		{ 16, 24, 60, 100, 200, 500, 1000, 2000 };
+
+	struct semaphore *sem = sm;
+	void *ptrs[KM5_SETSIZE];
+	unsigned i, j;
+
+	for (i=0; i<KM5_LOOPS; i++) {
+		for (j=0; j<KM5_SETSIZE; j++) {
+			ptrs[j] = kmalloc(sizes[(i + j) % KM5_SETSIZE]);
+			if (ptrs[j] == NULL) {
+				panic("kmalloctest5: thread %lu: "
+				      "kmalloc returned NULL\n", num);
+			}
+		}
+		for (j=0; j<KM5_SETSIZE; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+
+	V(sem);
+}
+
+static
+void
+kmalloctest5run(struct semaphore *sem, bool magazines)
+{
+	struct timespec before, after, duration;
+	uint64_t ns, allocs;
+	unsigned i;
+	int result;
+
+	kheap_setmagazines(magazines);
+
+	gettime(&before);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("kmalloctest5", NULL,
+				     kmalloctest5thread, sem, i);
+		if (result) {
+			panic("kmalloctest5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	ns = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	allocs = (uint64_t)NTHREADS * KM5_LOOPS * KM5_SETSIZE;
+	kprintf("%s: %llu allocations in %llu.%09lu seconds "
+		"(%llu allocations/sec)\n",
+		magazines ? "magazines" : "no magazines",
+		(unsigned long long)allocs,
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)duration.tv_nsec,
+		(unsigned long long)(ns == 0 ? 0 : allocs * 1000000000 / ns));
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct semaphore *sem;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("kmalloctest5", 0);
+	if (sem == NULL) {
+		panic("kmalloctest5: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc throughput test...\n");
+	kmalloctest5run(sem, false);
+	kmalloctest5run(sem, true);
+
+	sem_destroy(sem);
+	kprintf("kmalloc throughput test done\n");
+	return 0;
+}
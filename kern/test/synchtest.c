@@ -41,6 +41,9 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NBENCHLOOPS   2000
+#define NRWLOOPS      500
+#define NRWWRITES     50
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -220,6 +223,227 @@ locktest(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Lock contention benchmark: NTHREADS threads hammer one lock with a
+ * tiny critical section, once with an ordinary sleeping lock and once
+ * with an adaptive one.
+ */
+
+static struct lock *benchlock;
+static volatile unsigned long benchcount;
+
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		lock_acquire(benchlock);
+		benchcount++;
+		lock_release(benchlock);
+	}
+	V(donesem);
+}
+
+static
+void
+lockbench_run(const char *desc, struct lock *lk)
+{
+	struct timespec before, after, duration;
+	uint64_t nsecs, nacquires;
+	int i, result;
+
+	benchlock = lk;
+	benchcount = 0;
+
+	gettime(&before);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("lockbench", NULL, lockbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	nacquires = (uint64_t)NTHREADS * NBENCHLOOPS;
+	if (benchcount != nacquires) {
+		kprintf("lockbench: %s lock: count %lu, expected %llu\n",
+			desc, benchcount, (unsigned long long)nacquires);
+		kprintf("Test failed\n");
+	}
+
+	nsecs = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	if (nsecs == 0) {
+		nsecs = 1;
+	}
+	kprintf("%s lock: %llu acquisitions in %llu.%09lu seconds, "
+		"%llu/sec\n", desc, (unsigned long long)nacquires,
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)duration.tv_nsec,
+		(unsigned long long)(nacquires * 1000000000 / nsecs));
+	benchlock = NULL;
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	struct lock *lk;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting lock contention benchmark...\n");
+
+	lk = lock_create("lockbench");
+	if (lk == NULL) {
+		panic("lockbench: lock_create failed\n");
+	}
+	lockbench_run("Sleeping", lk);
+	lock_destroy(lk);
+
+	lk = lock_create_adaptive("lockbench");
+	if (lk == NULL) {
+		panic("lockbench: lock_create_adaptive failed\n");
+	}
+	lockbench_run("Adaptive", lk);
+	lock_destroy(lk);
+
+	kprintf("Lock contention benchmark done.\n");
+
+	return 0;
+}
+
+/*
+ * Reader-writer lock stress test: a writer keeps updating testval1-3
+ * while a growing number of readers check they are consistent. Prints
+ * the read rate at each reader count.
+ */
+
+static struct rwlock *testrwlock;
+static volatile bool rwtest_writing;
+
+static
+void
+rwtestreader(void *junk, unsigned long num)
+{
+	unsigned long v1, v2, v3;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		rwlock_acquire_read(testrwlock);
+		v1 = testval1;
+		v2 = testval2;
+		v3 = testval3;
+		if (v2 != v1*v1 || v3 != v1%3) {
+			kprintf("thread %lu: Inconsistent read %lu %lu %lu\n",
+				num, v1, v2, v3);
+			kprintf("Test failed\n");
+		}
+		rwlock_release_read(testrwlock);
+	}
+	V(donesem);
+}
+
+static
+void
+rwtestwriter(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; rwtest_writing; i++) {
+		rwlock_acquire_write(testrwlock);
+		testval1 = i;
+		thread_yield();
+		testval2 = testval1*testval1;
+		thread_yield();
+		testval3 = testval1%3;
+		rwlock_release_write(testrwlock);
+		if (i % NRWWRITES == 0) {
+			thread_yield();
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	uint64_t nsecs, nreads;
+	unsigned long nreaders;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrwlock = rwlock_create("testrwlock");
+	if (testrwlock == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+
+	kprintf("Starting rwlock test...\n");
+
+	rwtest_writing = true;
+	result = thread_fork("rwtest writer", NULL, rwtestwriter, NULL, 0);
+	if (result) {
+		panic("rwtest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	for (nreaders = 1; nreaders <= NTHREADS; nreaders *= 2) {
+		gettime(&before);
+		for (i=0; i<(int)nreaders; i++) {
+			result = thread_fork("rwtest reader", NULL,
+					     rwtestreader, NULL, i);
+			if (result) {
+				panic("rwtest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<(int)nreaders; i++) {
+			P(donesem);
+		}
+		gettime(&after);
+		timespec_sub(&after, &before, &duration);
+
+		nreads = (uint64_t)nreaders * NRWLOOPS;
+		nsecs = (uint64_t)duration.tv_sec * 1000000000
+			+ duration.tv_nsec;
+		if (nsecs == 0) {
+			nsecs = 1;
+		}
+		kprintf("%2lu readers: %llu reads/sec\n", nreaders,
+			(unsigned long long)(nreads * 1000000000 / nsecs));
+	}
+
+	rwtest_writing = false;
+	P(donesem);
+
+	rwlock_destroy(testrwlock);
+	testrwlock = NULL;
+
+	kprintf("rwlock test done.\n");
+
+	return 0;
+}
+
 static
 void
 cvtestthread(void *junk, unsigned long num)
@@ -31,7 +31,9 @@
  * Thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -144,3 +146,192 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Scheduler latency test.
+ *
+ * This is a kernel-thread version of the userlevel schedpong test
+ * (which needs fork and semaphore files and so can't run yet). A group
+ * of PONG_THREADS threads pass a token around a ring of semaphores;
+ * each handoff is timed from the V() to the moment the receiving
+ * thread gets the cpu. This is done first on an otherwise quiet
+ * system and then again with a number of CPU hogs running alongside.
+ * With a plain round-robin scheduler each handoff waits behind every
+ * hog's time slice; with the feedback scheduler the pongers stay at a
+ * higher priority and the hogs sink below them.
+ */
+
+#define PONG_THREADS	4
+#define PONG_ROUNDS	100
+#define PONG_HOGS	8
+#define PONG_MAXHOGS	32
+#define PONG_SAMPLES	(PONG_THREADS * PONG_ROUNDS)
+
+static struct semaphore *pong_sems[PONG_THREADS];
+static struct semaphore *pong_done;
+static volatile bool pong_hogs_stop;
+static struct timespec pong_sent;		/* written by token holder */
+static uint64_t pong_latency[PONG_SAMPLES];	/* ditto */
+static unsigned pong_nsamples;			/* ditto */
+
+static
+void
+pong_pass(unsigned to)
+{
+	gettime(&pong_sent);
+	V(pong_sems[to]);
+}
+
+static
+void
+pongthread(void *junk, unsigned long num)
+{
+	struct timespec now, diff;
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<PONG_ROUNDS; i++) {
+		P(pong_sems[num]);
+		gettime(&now);
+		timespec_sub(&now, &pong_sent, &diff);
+		KASSERT(pong_nsamples < PONG_SAMPLES);
+		pong_latency[pong_nsamples++] =
+			(uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+
+		if (num == PONG_THREADS - 1 && i == PONG_ROUNDS - 1) {
+			/* last handoff of the run; nobody left to take it */
+			break;
+		}
+		pong_pass((num + 1) % PONG_THREADS);
+	}
+	V(pong_done);
+}
+
+static
+void
+hogthread(void *junk, unsigned long num)
+{
+	volatile unsigned long spins = 0;
+
+	(void)junk;
+	(void)num;
+
+	while (!pong_hogs_stop) {
+		spins++;
+	}
+	V(pong_done);
+}
+
+static
+void
+pong_report(const char *what)
+{
+	uint64_t total, t;
+	unsigned i, j;
+
+	/* insertion sort; it's only a few hundred samples */
+	total = 0;
+	for (i=0; i<pong_nsamples; i++) {
+		t = pong_latency[i];
+		total += t;
+		for (j=i; j>0 && pong_latency[j-1] > t; j--) {
+			pong_latency[j] = pong_latency[j-1];
+		}
+		pong_latency[j] = t;
+	}
+
+	kprintf("%s: %u handoffs, mean %llu us, p99 %llu us, max %llu us\n",
+		what, pong_nsamples,
+		(unsigned long long)(total / pong_nsamples / 1000),
+		(unsigned long long)
+			(pong_latency[(pong_nsamples * 99 + 99) / 100 - 1] / 1000),
+		(unsigned long long)(pong_latency[pong_nsamples - 1] / 1000));
+}
+
+static
+void
+pong_run(unsigned nhogs)
+{
+	char name[16];
+	unsigned i;
+	int result;
+
+	pong_hogs_stop = false;
+	pong_nsamples = 0;
+
+	for (i=0; i<nhogs; i++) {
+		snprintf(name, sizeof(name), "hog%u", i);
+		result = thread_fork(name, NULL, hogthread, NULL, i);
+		if (result) {
+			panic("schedpong: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<PONG_THREADS; i++) {
+		snprintf(name, sizeof(name), "pong%u", i);
+		result = thread_fork(name, NULL, pongthread, NULL, i);
+		if (result) {
+			panic("schedpong: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/* Give the hogs time to use up their quanta, then serve. */
+	clocksleep(1);
+	pong_pass(0);
+
+	for (i=0; i<PONG_THREADS; i++) {
+		P(pong_done);
+	}
+	pong_hogs_stop = true;
+	for (i=0; i<nhogs; i++) {
+		P(pong_done);
+	}
+}
+
+int
+schedpong(int nargs, char **args)
+{
+	char name[16];
+	unsigned i, nhogs;
+
+	nhogs = PONG_HOGS;
+	if (nargs == 2) {
+		nhogs = atoi(args[1]);
+	}
+	if (nargs > 2 || nhogs > PONG_MAXHOGS) {
+		kprintf("Usage: tt4 [hogs 0-%u]\n", PONG_MAXHOGS);
+		return EINVAL;
+	}
+
+	for (i=0; i<PONG_THREADS; i++) {
+		snprintf(name, sizeof(name), "pong%u", i);
+		pong_sems[i] = sem_create(name, 0);
+		if (pong_sems[i] == NULL) {
+			panic("schedpong: sem_create failed\n");
+		}
+	}
+	pong_done = sem_create("pong_done", 0);
+	if (pong_done == NULL) {
+		panic("schedpong: sem_create failed\n");
+	}
+
+	kprintf("Starting schedpong: %u threads, %u rounds...\n",
+		PONG_THREADS, PONG_ROUNDS);
+	pong_run(0);
+	pong_report("idle");
+	if (nhogs > 0) {
+		pong_run(nhogs);
+		snprintf(name, sizeof(name), "%u hogs", nhogs);
+		pong_report(name);
+	}
+
+	sem_destroy(pong_done);
+	for (i=0; i<PONG_THREADS; i++) {
+		sem_destroy(pong_sems[i]);
+	}
+	kprintf("schedpong done.\n");
+
+	return 0;
+}
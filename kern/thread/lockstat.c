@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention statistics.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <membar.h>
+#include <spinlock.h>
+#include <lockstat.h>
+
+/* Number of records; primitives beyond this share lockstat_overflow. */
+#define LOCKSTAT_MAX		512
+
+/* Longest name kept in a record, including the terminating null. */
+#define LOCKSTAT_NAMELEN	24
+
+struct lockstat {
+	bool ls_inuse;			/* record is assigned */
+	bool ls_live;			/* primitive still exists */
+	const char *ls_kind;		/* "spinlock", "lock", "sem" */
+	char ls_name[LOCKSTAT_NAMELEN];
+	const void *ls_addr;		/* hook address, for spinlocks */
+	uint64_t ls_acquires;		/* acquisitions */
+	uint64_t ls_contended;		/* acquisitions that had to wait */
+	uint64_t ls_waittime;		/* total wait (ns) */
+	uint64_t ls_maxwait;		/* longest wait (ns) */
+	uint64_t ls_holdtime;		/* total hold (ns) */
+};
+
+static struct lockstat lockstat_table[LOCKSTAT_MAX];
+static struct lockstat lockstat_overflow = {
+	.ls_inuse = true,
+	.ls_live = true,
+	.ls_kind = "various",
+	.ls_name = "(table full)",
+};
+
+/*
+ * The table is protected by a bare spinlock word rather than a struct
+ * spinlock, because struct spinlocks call in here.
+ */
+static volatile spinlock_data_t lockstat_tablelock = SPINLOCK_DATA_INITIALIZER;
+
+static bool lockstat_enabled;
+
+static
+int
+lockstat_lock(void)
+{
+	int s;
+
+	s = splhigh();
+	while (spinlock_data_get(&lockstat_tablelock) != 0 ||
+	       spinlock_data_testandset(&lockstat_tablelock) != 0) {
+		/* spin */
+	}
+	membar_store_any();
+	return s;
+}
+
+static
+void
+lockstat_unlock(int s)
+{
+	membar_any_store();
+	spinlock_data_set(&lockstat_tablelock, 0);
+	splx(s);
+}
+
+void
+lockstat_bootstrap(void)
+{
+	lockstat_enabled = true;
+}
+
+uint64_t
+lockstat_now(void)
+{
+	struct timespec ts;
+
+	if (!lockstat_enabled) {
+		return 0;
+	}
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+lockstat_init(struct lockstat_hook *h)
+{
+	h->lh_stat = NULL;
+	h->lh_acquired = 0;
+}
+
+void
+lockstat_cleanup(struct lockstat_hook *h)
+{
+	int s;
+
+	if (h->lh_stat != NULL && h->lh_stat != &lockstat_overflow) {
+		s = lockstat_lock();
+		h->lh_stat->ls_live = false;
+		lockstat_unlock(s);
+	}
+	h->lh_stat = NULL;
+}
+
+/*
+ * Find a record for a hook: a free one if there is one, otherwise one
+ * whose primitive has been destroyed, otherwise the overflow record.
+ */
+static
+struct lockstat *
+lockstat_attach(struct lockstat_hook *h, const char *kind, const char *name)
+{
+	struct lockstat *ls, *dead;
+	unsigned i;
+	int s;
+
+	s = lockstat_lock();
+	ls = dead = NULL;
+	for (i=0; i<LOCKSTAT_MAX; i++) {
+		if (!lockstat_table[i].ls_inuse) {
+			ls = &lockstat_table[i];
+			break;
+		}
+		if (dead == NULL && !lockstat_table[i].ls_live) {
+			dead = &lockstat_table[i];
+		}
+	}
+	if (ls == NULL) {
+		ls = dead;
+	}
+	if (ls != NULL) {
+		bzero(ls, sizeof(*ls));
+		ls->ls_inuse = true;
+		ls->ls_live = true;
+		ls->ls_kind = kind;
+		if (name != NULL) {
+			snprintf(ls->ls_name, sizeof(ls->ls_name), "%s", name);
+		}
+		ls->ls_addr = h;
+	}
+	else {
+		ls = &lockstat_overflow;
+	}
+	lockstat_unlock(s);
+
+	h->lh_stat = ls;
+	return ls;
+}
+
+void
+lockstat_acquired(struct lockstat_hook *h, const char *kind,
+		  const char *name, uint64_t waitstart)
+{
+	struct lockstat *ls;
+	uint64_t now, wait;
+	int s = 0;
+
+	if (!lockstat_enabled) {
+		return;
+	}
+
+	ls = h->lh_stat;
+	if (ls == NULL) {
+		ls = lockstat_attach(h, kind, name);
+	}
+
+	now = lockstat_now();
+	wait = (waitstart != 0) ? now - waitstart : 0;
+	h->lh_acquired = now;
+
+	/* The overflow record is shared, so it needs the table lock. */
+	if (ls == &lockstat_overflow) {
+		s = lockstat_lock();
+	}
+	ls->ls_acquires++;
+	if (waitstart != 0) {
+		ls->ls_contended++;
+		ls->ls_waittime += wait;
+		if (wait > ls->ls_maxwait) {
+			ls->ls_maxwait = wait;
+		}
+	}
+	if (ls == &lockstat_overflow) {
+		lockstat_unlock(s);
+	}
+}
+
+void
+lockstat_released(struct lockstat_hook *h)
+{
+	struct lockstat *ls;
+	uint64_t hold;
+	int s = 0;
+
+	ls = h->lh_stat;
+	if (!lockstat_enabled || ls == NULL || h->lh_acquired == 0) {
+		return;
+	}
+
+	hold = lockstat_now() - h->lh_acquired;
+	h->lh_acquired = 0;
+
+	if (ls == &lockstat_overflow) {
+		s = lockstat_lock();
+	}
+	ls->ls_holdtime += hold;
+	if (ls == &lockstat_overflow) {
+		lockstat_unlock(s);
+	}
+}
+
+/*
+ * Record I of the table, with LOCKSTAT_MAX meaning the overflow record.
+ */
+static
+struct lockstat *
+lockstat_record(unsigned i)
+{
+	return i < LOCKSTAT_MAX ? &lockstat_table[i] : &lockstat_overflow;
+}
+
+void
+lockstat_print(unsigned n)
+{
+	struct lockstat *snap, *ls, *best;
+	unsigned *picked;
+	unsigned i, j, k, bestidx;
+	int s;
+
+	/* Allocate before taking the table lock; kmalloc uses locks. */
+	snap = kmalloc(n * sizeof(*snap));
+	picked = kmalloc(n * sizeof(*picked));
+	if (snap == NULL || picked == NULL) {
+		kfree(snap);
+		kfree(picked);
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+
+	/*
+	 * Copy out the top N by wait time under the table lock, and
+	 * print them afterwards, since printing takes locks too.
+	 */
+	s = lockstat_lock();
+	for (k=0; k<n; k++) {
+		best = NULL;
+		bestidx = 0;
+		for (i=0; i<=LOCKSTAT_MAX; i++) {
+			ls = lockstat_record(i);
+			if (!ls->ls_inuse || ls->ls_acquires == 0) {
+				continue;
+			}
+			for (j=0; j<k && picked[j] != i; j++) {
+				/* nothing */
+			}
+			if (j < k) {
+				continue;
+			}
+			if (best == NULL || ls->ls_waittime > best->ls_waittime) {
+				best = ls;
+				bestidx = i;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		picked[k] = bestidx;
+		snap[k] = *best;
+	}
+	lockstat_unlock(s);
+
+	kprintf("%-24s %-8s %10s %10s %12s %10s %12s\n", "name", "kind",
+		"acquires", "contended", "wait(us)", "max(us)", "hold(us)");
+	for (i=0; i<k; i++) {
+		ls = &snap[i];
+		if (ls->ls_name[0] != 0) {
+			kprintf("%-24s ", ls->ls_name);
+		}
+		else {
+			kprintf("%-24p ", ls->ls_addr);
+		}
+		kprintf("%-8s %10llu %10llu %12llu %10llu %12llu%s\n",
+			ls->ls_kind,
+			(unsigned long long)ls->ls_acquires,
+			(unsigned long long)ls->ls_contended,
+			(unsigned long long)(ls->ls_waittime / 1000),
+			(unsigned long long)(ls->ls_maxwait / 1000),
+			(unsigned long long)(ls->ls_holdtime / 1000),
+			ls->ls_live ? "" : " (gone)");
+	}
+
+	kfree(picked);
+	kfree(snap);
+}
+
+/*
+ * Zero everything. Counts for primitives that are in use while this
+ * runs may come out slightly off; this is a profiling aid, not an
+ * accounting system.
+ */
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+	int s;
+
+	s = lockstat_lock();
+	for (i=0; i<=LOCKSTAT_MAX; i++) {
+		ls = lockstat_record(i);
+		if (!ls->ls_live) {
+			ls->ls_inuse = false;
+		}
+		ls->ls_acquires = 0;
+		ls->ls_contended = 0;
+		ls->ls_waittime = 0;
+		ls->ls_maxwait = 0;
+		ls->ls_holdtime = 0;
+	}
+	lockstat_unlock(s);
+}
@@ -52,6 +52,9 @@ spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
+#if OPT_LOCKSTAT
+	lockstat_init(&splk->splk_lockstat);
+#endif
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
@@ -63,6 +66,9 @@ spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
 	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+#if OPT_LOCKSTAT
+	lockstat_cleanup(&splk->splk_lockstat);
+#endif
 }
 
 /*
@@ -76,6 +82,9 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+#if OPT_LOCKSTAT
+	uint64_t waitstart = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -105,6 +114,11 @@ spinlock_acquire(struct spinlock *splk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&splk->splk_lock) != 0) {
+#if OPT_LOCKSTAT
+			if (waitstart == 0) {
+				waitstart = lockstat_now();
+			}
+#endif
 			continue;
 		}
 		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
@@ -116,6 +130,10 @@ spinlock_acquire(struct spinlock *splk)
 	membar_store_any();
 	splk->splk_holder = mycpu;
 
+#if OPT_LOCKSTAT
+	lockstat_acquired(&splk->splk_lockstat, "spinlock", NULL, waitstart);
+#endif
+
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
@@ -135,6 +153,9 @@ spinlock_release(struct spinlock *splk)
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
+#if OPT_LOCKSTAT
+	lockstat_released(&splk->splk_lockstat);
+#endif
 	splk->splk_holder = NULL;
 	membar_any_store();
 	spinlock_data_set(&splk->splk_lock, 0);
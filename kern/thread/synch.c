@@ -33,13 +33,108 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
 
+/*
+ * Wait channel and its spinlock for lock_acquire_set. The spinlock
+ * comes before any lock's lk_lock in the lock order.
+ */
+static struct spinlock lockset_spinlock = SPINLOCK_INITIALIZER;
+static struct wchan *lockset_wchan;
+
+/*
+ * Object caches for semaphores, locks, and CVs. Each of these owns a
+ * wait channel, which the constructor makes once and the destructor
+ * gets rid of; in between, the object keeps it (renamed to match)
+ * across however many times it is created and destroyed.
+ */
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_wchan = wchan_create("sem");
+	return sem->sem_wchan == NULL ? ENOMEM : 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	wchan_destroy(sem->sem_wchan);
+}
+
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	return lock->lk_wchan == NULL ? ENOMEM : 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	wchan_destroy(lock->lk_wchan);
+}
+
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_wchan = wchan_create("cv");
+	return cv->cv_wchan == NULL ? ENOMEM : 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	wchan_destroy(cv->cv_wchan);
+}
+
+void
+synch_bootstrap(void)
+{
+	sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+				      sem_ctor, sem_dtor);
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       lock_ctor, lock_dtor);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv),
+				     cv_ctor, cv_dtor);
+	if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+
+	lockset_wchan = wchan_create("lockset");
+	if (lockset_wchan == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
@@ -49,26 +144,24 @@ sem_create(const char *name, unsigned initial_count)
 {
 	struct semaphore *sem;
 	
-	sem = kmalloc(sizeof(*sem));
+	sem = kmem_cache_alloc(sem_cache);
 	if (sem == NULL) {
 		return NULL;
 	}
 	
 	sem->sem_name = kstrdup(name);
 	if (sem->sem_name == NULL) {
-		kfree(sem);
+		kmem_cache_free(sem_cache, sem);
 		return NULL;
 	}
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
+	wchan_setname(sem->sem_wchan, sem->sem_name);
 
 	spinlock_init(&sem->sem_lock);
 	sem->sem_count = initial_count;
+#if OPT_LOCKSTAT
+	lockstat_init(&sem->sem_lockstat);
+#endif
 
 	return sem;
 }
@@ -78,16 +171,27 @@ sem_destroy(struct semaphore *sem)
 {
 	KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
+	/* The wchan goes back to the cache with us; it must be empty */
+	spinlock_acquire(&sem->sem_lock);
+	KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+	spinlock_release(&sem->sem_lock);
+
 	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+#if OPT_LOCKSTAT
+	lockstat_cleanup(&sem->sem_lockstat);
+#endif
+	wchan_setname(sem->sem_wchan, "sem");
 	kfree(sem->sem_name);
-	kfree(sem);
+	kmem_cache_free(sem_cache, sem);
 }
 
 void
 P(struct semaphore *sem)
 {
+#if OPT_LOCKSTAT
+	uint64_t waitstart = 0;
+#endif
+
 	KASSERT(sem != NULL);
 
 	/*
@@ -100,6 +204,11 @@ P(struct semaphore *sem)
 
 	/* Use the semaphore spinlock to protect the wchan as well. */
 	spinlock_acquire(&sem->sem_lock);
+#if OPT_LOCKSTAT
+	if (sem->sem_count == 0) {
+		waitstart = lockstat_now();
+	}
+#endif
 	while (sem->sem_count == 0) {
 		/*
 		 *
@@ -117,6 +226,9 @@ P(struct semaphore *sem)
 	}
 	KASSERT(sem->sem_count > 0);
 	sem->sem_count--;
+#if OPT_LOCKSTAT
+	lockstat_acquired(&sem->sem_lockstat, "sem", sem->sem_name, waitstart);
+#endif
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -138,52 +250,97 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+static
 struct lock *
-lock_create(const char *name)
+lock_create_common(const char *name, bool adaptive)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(*lock));
+	lock = kmem_cache_alloc(lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		kmem_cache_free(lock_cache, lock);
 		return NULL;
 	}
 
 	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
+	wchan_setname(lock->lk_wchan, lock->lk_name);
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	lock->lk_setwaiters = 0;
+	lock->lk_adaptive = adaptive;
+#if OPT_LOCKSTAT
+	lockstat_init(&lock->lk_lockstat);
+#endif
 
 	return lock;
 }
 
+struct lock *
+lock_create(const char *name)
+{
+	return lock_create_common(name, false);
+}
+
+struct lock *
+lock_create_adaptive(const char *name)
+{
+	return lock_create_common(name, true);
+}
+
 void
 lock_destroy(struct lock *lock)
 {
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_setwaiters == 0);
+
+	/* The wchan goes back to the cache with us; it must be empty */
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(wchan_isempty(lock->lk_wchan, &lock->lk_lock));
+	spinlock_release(&lock->lk_lock);
+
 	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
+#if OPT_LOCKSTAT
+	lockstat_cleanup(&lock->lk_lockstat);
+#endif
+	wchan_setname(lock->lk_wchan, "lock");
 
 	kfree(lock->lk_name);
-	kfree(lock);
+	kmem_cache_free(lock_cache, lock);
+}
+
+/*
+ * Check if HOLDER is running on some other CPU, for adaptive locks.
+ *
+ * This is called without any lock that keeps HOLDER from exiting, so
+ * the thread structure may already have been freed. That is harmless:
+ * we only compare fields and never follow t_cpu, and the caller
+ * rechecks lk_holder, which will have changed if HOLDER has gone.
+ */
+static
+bool
+lock_holder_running(struct thread *holder)
+{
+	volatile struct thread *h = holder;	/* reread each time */
+
+	return h->t_state == S_RUN && h->t_cpu != curcpu->c_self;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+#if OPT_LOCKSTAT
+	uint64_t waitstart = 0;
+#endif
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,11 +350,33 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
+#if OPT_LOCKSTAT
+	if (lock->lk_holder != NULL) {
+		waitstart = lockstat_now();
+	}
+#endif
+	while ((holder = lock->lk_holder) != NULL) {
+		if (lock->lk_adaptive && lock_holder_running(holder)) {
+			/*
+			 * Spin, without the spinlock and with
+			 * interrupts on, until the holder either lets
+			 * go or stops running; then look again.
+			 */
+			spinlock_release(&lock->lk_lock);
+			while (lock->lk_holder == holder &&
+			       lock_holder_running(holder)) {
+				/* spin */
+			}
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
 		/* As in the semaphore. */
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
+#if OPT_LOCKSTAT
+	lockstat_acquired(&lock->lk_lockstat, "lock", lock->lk_name, waitstart);
+#endif
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
@@ -208,18 +387,36 @@ lock_acquire(struct lock *lock)
 void
 lock_release(struct lock *lock)
 {
+	unsigned setwaiters;
+
 	DEBUGASSERT(lock != NULL);
 
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
+#if OPT_LOCKSTAT
+	lockstat_released(&lock->lk_lockstat);
+#endif
 	lock->lk_holder = NULL;
 	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 
 	/* Call this (atomically) when the lock is released */
 	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
 
+	setwaiters = lock->lk_setwaiters;
 	spinlock_release(&lock->lk_lock);
+
+	/*
+	 * If a lock_acquire_set caller is waiting on this lock, let it
+	 * recheck its set. It incremented lk_setwaiters before dropping
+	 * lk_lock and holds lockset_spinlock until it is asleep, so it
+	 * either saw lk_holder go NULL or it is on the wchan by now.
+	 */
+	if (setwaiters > 0) {
+		spinlock_acquire(&lockset_spinlock);
+		wchan_wakeall(lockset_wchan, &lockset_spinlock);
+		spinlock_release(&lockset_spinlock);
+	}
 }
 
 bool
@@ -236,6 +433,91 @@ lock_do_i_hold(struct lock *lock)
 	return ret;
 }
 
+void
+lock_acquire_set(struct lock **locks, unsigned n)
+{
+	unsigned i;
+	bool busy;
+#if OPT_LOCKSTAT
+	uint64_t waitstart = 0;
+#endif
+
+	KASSERT(locks != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	/*
+	 * Only one set is examined at a time, under lockset_spinlock,
+	 * so taking several lk_locks at once here cannot deadlock;
+	 * everyone else only ever holds one lk_lock.
+	 */
+	spinlock_acquire(&lockset_spinlock);
+	for (i = 0; i < n; i++) {
+		spinlock_acquire(&locks[i]->lk_lock);
+		KASSERT(locks[i]->lk_holder != curthread);
+		locks[i]->lk_setwaiters++;
+	}
+
+	while (1) {
+		busy = false;
+		for (i = 0; i < n; i++) {
+			if (locks[i]->lk_holder != NULL) {
+				busy = true;
+				break;
+			}
+		}
+		if (!busy) {
+			break;
+		}
+#if OPT_LOCKSTAT
+		if (waitstart == 0) {
+			waitstart = lockstat_now();
+		}
+#endif
+
+		/* wchan_sleep wants only the wchan's spinlock held */
+		for (i = n; i-- > 0; ) {
+			spinlock_release(&locks[i]->lk_lock);
+		}
+		wchan_sleep(lockset_wchan, &lockset_spinlock);
+		for (i = 0; i < n; i++) {
+			spinlock_acquire(&locks[i]->lk_lock);
+		}
+	}
+
+	/*
+	 * All free: take them all. There was no hold-and-wait, so
+	 * tell the deadlock detector about each lock as if it had been
+	 * acquired without blocking.
+	 */
+	for (i = 0; i < n; i++) {
+		locks[i]->lk_setwaiters--;
+		HANGMAN_WAIT(&curthread->t_hangman, &locks[i]->lk_hangman);
+		locks[i]->lk_holder = curthread;
+#if OPT_LOCKSTAT
+		lockstat_acquired(&locks[i]->lk_lockstat, "lock",
+				  locks[i]->lk_name, waitstart);
+#endif
+		HANGMAN_ACQUIRE(&curthread->t_hangman, &locks[i]->lk_hangman);
+	}
+
+	for (i = n; i-- > 0; ) {
+		spinlock_release(&locks[i]->lk_lock);
+	}
+	spinlock_release(&lockset_spinlock);
+}
+
+void
+lock_release_set(struct lock **locks, unsigned n)
+{
+	unsigned i;
+
+	KASSERT(locks != NULL);
+
+	for (i = n; i-- > 0; ) {
+		lock_release(locks[i]);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -246,23 +528,18 @@ cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(*cv));
+	cv = kmem_cache_alloc(cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name==NULL) {
-		kfree(cv);
+		kmem_cache_free(cv_cache, cv);
 		return NULL;
 	}
 
-	cv->cv_wchan = wchan_create(cv->cv_name);
-	if (cv->cv_wchan == NULL) {
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-	}
+	wchan_setname(cv->cv_wchan, cv->cv_name);
 
 	spinlock_init(&cv->cv_wchanlock);
 	return cv;
@@ -273,11 +550,16 @@ cv_destroy(struct cv *cv)
 {
 	KASSERT(cv != NULL);
 
+	/* The wchan goes back to the cache with us; it must be empty */
+	spinlock_acquire(&cv->cv_wchanlock);
+	KASSERT(wchan_isempty(cv->cv_wchan, &cv->cv_wchanlock));
+	spinlock_release(&cv->cv_wchanlock);
+
 	spinlock_cleanup(&cv->cv_wchanlock);
-	wchan_destroy(cv->cv_wchan);
+	wchan_setname(cv->cv_wchan, "cv");
 
 	kfree(cv->cv_name);
-	kfree(cv);
+	kmem_cache_free(cv_cache, cv);
 }
 
 void
@@ -315,3 +597,157 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	HANGMAN_LOCKABLEINIT(&rw->rw_hangman, rw->rw_name);
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writerswaiting == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+
+	HANGMAN_WAIT(&curthread->t_hangman, &rw->rw_hangman);
+
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0) {
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+
+	/*
+	 * The deadlock detector only knows about one holder at a
+	 * time, so take and drop the hold right away; that clears our
+	 * wait and the lock is never recorded as held by a reader.
+	 */
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &rw->rw_hangman);
+	HANGMAN_RELEASE(&curthread->t_hangman, &rw->rw_hangman);
+
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0) {
+		/* Last reader out lets a writer in. */
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+
+	HANGMAN_WAIT(&curthread->t_hangman, &rw->rw_hangman);
+
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &rw->rw_hangman);
+
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+
+	/*
+	 * Prefer the next writer; only if there is none let all the
+	 * readers that piled up behind us in.
+	 */
+	if (rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+
+	HANGMAN_RELEASE(&curthread->t_hangman, &rw->rw_hangman);
+
+	spinlock_release(&rw->rw_lock);
+}
@@ -71,6 +71,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Object caches for thread and wchan structures. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -122,14 +126,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -142,6 +146,9 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastrun = 0;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
 	/* Interrupt state fields */
@@ -167,6 +174,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -183,7 +191,9 @@ cpu_create(unsigned hardware_number)
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -286,7 +296,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -316,6 +326,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -330,9 +343,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -375,6 +391,14 @@ thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL, NULL);
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					NULL, NULL);
+	if (thread_cache == NULL || wchan_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -444,6 +468,141 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue handling. Each cpu has one run queue per priority level;
+ * a thread goes on the queue for its current t_priority, and the
+ * highest-priority nonempty queue is served first. These must be
+ * called with the cpu's run queue lock held.
+ */
+
+/* Add a thread to the tail of its level's queue. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+}
+
+/* Take the next thread to run: the head of the highest nonempty level. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Count the threads waiting to run on a cpu. */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+/*
+ * Work stealing.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. So we only move a thread that is already
+ * cache-cold: one that hasn't run on its CPU for at least
+ * MIGRATE_COLD_HARDCLOCKS ticks, by which time whatever else ran there
+ * has most likely pushed it out of the cache anyway. A thread that
+ * has been waiting that long is also one that its own CPU is not
+ * getting around to.
+ *
+ * The thief looks for the busiest CPU without taking any locks (the
+ * counts are only a hint) and then locks just that one run queue. It
+ * never holds two run queue locks at once, so there is no ordering to
+ * worry about between CPUs stealing from each other.
+ */
+#define MIGRATE_COLD_HARDCLOCKS	4
+
+/*
+ * Take one cache-cold thread from the busiest other CPU, provided it
+ * has at least MINLOAD threads waiting. The thread is returned
+ * belonging to the current CPU but on no run queue; the caller must
+ * not be holding any run queue lock.
+ */
+static
+struct thread *
+thread_steal(unsigned minload)
+{
+	struct cpu *c, *busiest;
+	struct thread *t;
+	unsigned i, numcpus, count, maxcount;
+
+	busiest = NULL;
+	maxcount = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		count = runqueue_count(c);
+		if (count > maxcount) {
+			maxcount = count;
+			busiest = c;
+		}
+	}
+	if (busiest == NULL || maxcount < minload) {
+		return NULL;
+	}
+
+	spinlock_acquire(&busiest->c_runqueue_lock);
+	t = NULL;
+	/* Lowest priority first; those will wait longest where they are. */
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, busiest->c_runqueue[i]) {
+			/*
+			 * Ordinarily the other cpu's curthread will
+			 * not appear on its run queue. However, it
+			 * can if it went to sleep, the cpu went idle
+			 * so it remained curthread, and it was woken
+			 * up again before the cpu got around to
+			 * unidling. Migrating it then would be very
+			 * bad, so skip it.
+			 */
+			if (t != busiest->c_curthread &&
+			    busiest->c_hardclocks - t->t_lastrun >=
+			    MIGRATE_COLD_HARDCLOCKS) {
+				break;
+			}
+		}
+		if (t != NULL) {
+			threadlist_remove(&busiest->c_runqueue[i], t);
+			break;
+		}
+	}
+	spinlock_release(&busiest->c_runqueue_lock);
+
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+		/* It counts as warm here, so it doesn't bounce straight on. */
+		t->t_lastrun = curcpu->c_hardclocks;
+		DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+		      t->t_name, busiest->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -468,7 +627,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -590,12 +749,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu->c_self) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Note when it last ran here, for thread_steal. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -643,10 +805,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/*
+			 * Before idling, see if anyone has work to spare,
+			 * then if the VM has any (one page's worth, since
+			 * interrupts are off).
+			 */
+			next = thread_steal(1);
+			if (next == NULL && !vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -827,139 +997,129 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Threads start at level 0, the
+ * highest priority, and each level has a quantum twice as long as the
+ * one above it. A thread that runs for its whole quantum is taken to
+ * be compute-bound and moves down a level (thread_charge_tick); one
+ * that goes to sleep and is woken up moves back up a level
+ * (thread_promote). Interactive threads therefore stay near the top
+ * and get the cpu promptly, while CPU hogs sink to the bottom and
+ * share what is left in long slices.
+ *
+ * Left to itself this starves the bottom levels whenever there is
+ * enough interactive work, so schedule(), which is called
+ * periodically from hardclock(), puts everything back at level 0.
  */
 
+/* Length of the quantum at level LEVEL, in hardclocks. */
+#define SCHED_QUANTUM(level)	(1U << (level))
+
+/*
+ * A thread being woken up slept before its quantum ran out; move it
+ * up a level. It is on no run queue at this point, so the caller
+ * need only hold the lock for the wait channel it came off.
+ */
+static
 void
-schedule(void)
+thread_promote(struct thread *t)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	if (t->t_priority > 0) {
+		t->t_priority--;
+	}
+	t->t_ticks = 0;
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Charge one hardclock to curthread. Returns true if it has used up
+ * its quantum, in which case it is also demoted, or if something of
+ * higher priority is waiting on this cpu.
  */
-void
-thread_consider_migration(void)
+bool
+thread_charge_tick(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct thread *cur;
+	bool yield;
+	unsigned i;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (curcpu->c_isidle) {
+		/* curthread isn't really running; leave it alone */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return false;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	cur = curthread;
+	yield = false;
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		yield = true;
+	}
+	else {
+		for (i=0; i<cur->t_priority; i++) {
+			if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+				yield = true;
+				break;
+			}
+		}
 	}
+
 	spinlock_release(&curcpu->c_runqueue_lock);
+	return yield;
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+/*
+ * Priority boost: move every thread on this cpu back to level 0.
+ */
+void
+schedule(void)
+{
+	struct thread *t;
+	unsigned i;
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+/*
+ * Thread migration.
+ *
+ * This is also called periodically from hardclock(). If some other
+ * CPU has at least two more threads waiting than this one, pull one
+ * across. Idle CPUs do the same thing from the idle loop in
+ * thread_switch with a threshold of one, so work flows to where the
+ * spare cycles are without the busy CPUs having to go looking for
+ * them. See thread_steal for the cache affinity rules.
+ */
+void
+thread_consider_migration(void)
+{
+	struct thread *t;
+
+	/* Unlocked peek, like the ones in thread_steal. */
+	t = thread_steal(runqueue_count(curcpu->c_self) + 2);
+	if (t == NULL) {
+		return;
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_add(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -981,7 +1141,7 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
@@ -999,7 +1159,18 @@ void
 wchan_destroy(struct wchan *wc)
 {
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(wchan_cache, wc);
+}
+
+/*
+ * Change the name of a wait channel. The same rules apply to NAME as
+ * in wchan_create. This is for objects that keep one wait channel
+ * across several lives, like the ones in synch.c's object caches.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 
 /*
@@ -1043,6 +1214,8 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 		return;
 	}
 
+	thread_promote(target);
+
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
 	 * while we're holding LK. This is ok; all spinlocks
@@ -1081,6 +1254,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_promote(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1145,12 +1319,25 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
+	ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+/*
+ * Send a batch of N TLB shootdowns to the specified CPU, with a
+ * single IPI.
+ */
+void
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i, num;
+
+	KASSERT(n > 0);
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	num = target->c_numshootdown;
+	if (num + n > TLBSHOOTDOWN_MAX) {
 		/*
 		 * If you have problems with this panic going off,
 		 * consider: (1) increasing the maximum, (2) putting
@@ -1163,8 +1350,10 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		for (i=0; i<n; i++) {
+			target->c_shootdown[num + i] = mappings[i];
+		}
+		target->c_numshootdown = num + n;
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
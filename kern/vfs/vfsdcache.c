@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VFS name cache ("dcache"): remembers what a name in a directory
+ * refers to, or that it doesn't exist, so vfs_lookup can skip the
+ * filesystem's directory search.
+ *
+ * The cache doesn't hold references to the vnodes in it. Instead the
+ * filesystem purges a vnode from it when reclaiming the vnode (see
+ * vfs_dcache_purgevnode below). A hit takes a reference under the
+ * cache lock, so the vnode can't be reclaimed underneath it.
+ *
+ * Entries are only ever made by the filesystem, so filesystems that
+ * don't call vfs_dcache_enter (and thus don't have to keep it up to
+ * date) always miss.
+ *
+ * There is a fixed pool of entries, recycled in LRU order. Each is on
+ * three hash chains: by (directory, name) for lookups, by directory
+ * and by target vnode for purging. dc_lock covers all of it; it is a
+ * spinlock and a leaf lock, except that VOP_INCREF is done inside it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define DCACHE_NAMELEN		32	/* longer names aren't cached */
+#define DCACHE_NENTRIES		512
+#define DCACHE_NHASH		256	/* hash buckets (power of 2) */
+#define DCACHE_HASHBITS		8	/* log2(DCACHE_NHASH) */
+
+struct dcentry {
+	struct vnode *de_dir;		/* key: directory; NULL if unused */
+	char de_name[DCACHE_NAMELEN];	/* key: name */
+	unsigned de_hash;		/* hash of the key */
+	struct vnode *de_vn;		/* target; NULL if negative */
+	struct dcentry *de_namenext;	/* chain in dc_byname */
+	struct dcentry *de_dirnext;	/* chain in dc_bydir */
+	struct dcentry *de_vnnext;	/* chain in dc_byvn (if de_vn) */
+	struct dcentry *de_lruprev;	/* LRU list, oldest first */
+	struct dcentry *de_lrunext;
+};
+
+static struct spinlock dc_lock = SPINLOCK_INITIALIZER;
+static struct dcentry dc_entries[DCACHE_NENTRIES];
+static struct dcentry *dc_byname[DCACHE_NHASH];
+static struct dcentry *dc_bydir[DCACHE_NHASH];
+static struct dcentry *dc_byvn[DCACHE_NHASH];
+static struct dcentry *dc_lruhead, *dc_lrutail;
+
+struct dcstats {
+	unsigned lookups;	/* vfs_dcache_lookup calls */
+	unsigned hits;		/* found a vnode */
+	unsigned neghits;	/* found a negative entry */
+	unsigned enters;	/* entries made */
+	unsigned purges;	/* entries dropped by invalidation */
+	unsigned evictions;	/* entries dropped to make room */
+};
+
+static struct dcstats dc_stats;
+
+////////////////////////////////////////////////////////////
+// Hashing and list handling
+
+static
+unsigned
+dc_vnhash(const struct vnode *vn)
+{
+	return (uint32_t)(((uintptr_t)vn >> 3) * 0x9e3779b1U) >>
+		(32 - DCACHE_HASHBITS);
+}
+
+static
+unsigned
+dc_namehash(const struct vnode *dir, const char *name)
+{
+	uint32_t h;
+
+	h = 2166136261U ^ (uint32_t)((uintptr_t)dir >> 3);
+	while (*name != 0) {
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	}
+	return h;
+}
+
+static
+void
+dc_lru_remove(struct dcentry *de)
+{
+	if (de->de_lruprev != NULL) {
+		de->de_lruprev->de_lrunext = de->de_lrunext;
+	}
+	else {
+		dc_lruhead = de->de_lrunext;
+	}
+	if (de->de_lrunext != NULL) {
+		de->de_lrunext->de_lruprev = de->de_lruprev;
+	}
+	else {
+		dc_lrutail = de->de_lruprev;
+	}
+	de->de_lruprev = de->de_lrunext = NULL;
+}
+
+static
+void
+dc_lru_addhead(struct dcentry *de)
+{
+	de->de_lruprev = NULL;
+	de->de_lrunext = dc_lruhead;
+	if (dc_lruhead != NULL) {
+		dc_lruhead->de_lruprev = de;
+	}
+	else {
+		dc_lrutail = de;
+	}
+	dc_lruhead = de;
+}
+
+static
+void
+dc_lru_addtail(struct dcentry *de)
+{
+	de->de_lrunext = NULL;
+	de->de_lruprev = dc_lrutail;
+	if (dc_lrutail != NULL) {
+		dc_lrutail->de_lrunext = de;
+	}
+	else {
+		dc_lruhead = de;
+	}
+	dc_lrutail = de;
+}
+
+/*
+ * Find the entry for NAME in DIR, whose key hashes to HASH.
+ */
+static
+struct dcentry *
+dc_find(struct vnode *dir, const char *name, unsigned hash)
+{
+	struct dcentry *de;
+
+	KASSERT(spinlock_do_i_hold(&dc_lock));
+
+	for (de = dc_byname[hash % DCACHE_NHASH]; de != NULL;
+	     de = de->de_namenext) {
+		if (de->de_hash == hash && de->de_dir == dir &&
+		    !strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry off its hash chains and put it at the head of the
+ * LRU list, to be reused first.
+ */
+static
+void
+dc_remove(struct dcentry *de)
+{
+	struct dcentry **pp;
+
+	KASSERT(spinlock_do_i_hold(&dc_lock));
+	KASSERT(de->de_dir != NULL);
+
+	pp = &dc_byname[de->de_hash % DCACHE_NHASH];
+	while (*pp != de) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->de_namenext;
+	}
+	*pp = de->de_namenext;
+
+	pp = &dc_bydir[dc_vnhash(de->de_dir)];
+	while (*pp != de) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->de_dirnext;
+	}
+	*pp = de->de_dirnext;
+
+	if (de->de_vn != NULL) {
+		pp = &dc_byvn[dc_vnhash(de->de_vn)];
+		while (*pp != de) {
+			KASSERT(*pp != NULL);
+			pp = &(*pp)->de_vnnext;
+		}
+		*pp = de->de_vnnext;
+	}
+
+	de->de_dir = NULL;
+	de->de_vn = NULL;
+	de->de_namenext = de->de_dirnext = de->de_vnnext = NULL;
+
+	dc_lru_remove(de);
+	dc_lru_addhead(de);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Setup function.
+ */
+void
+vfs_dcache_bootstrap(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&dc_lock);
+	for (i=0; i<DCACHE_NENTRIES; i++) {
+		bzero(&dc_entries[i], sizeof(dc_entries[i]));
+		dc_lru_addtail(&dc_entries[i]);
+	}
+	spinlock_release(&dc_lock);
+}
+
+/*
+ * Look up NAME in DIR. On a hit, return true and hand back the vnode
+ * (with a reference) in RET, or NULL if the name is known not to
+ * exist. On a miss, return false.
+ */
+bool
+vfs_dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *de;
+	unsigned hash;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return false;
+	}
+	hash = dc_namehash(dir, name);
+
+	spinlock_acquire(&dc_lock);
+	dc_stats.lookups++;
+	de = dc_find(dir, name, hash);
+	if (de == NULL) {
+		spinlock_release(&dc_lock);
+		return false;
+	}
+	if (de->de_vn != NULL) {
+		VOP_INCREF(de->de_vn);
+		dc_stats.hits++;
+	}
+	else {
+		dc_stats.neghits++;
+	}
+	*ret = de->de_vn;
+	dc_lru_remove(de);
+	dc_lru_addtail(de);
+	spinlock_release(&dc_lock);
+
+	return true;
+}
+
+/*
+ * Record that NAME in DIR refers to VN, or doesn't exist if VN is
+ * NULL, replacing anything already recorded for it. Multi-component
+ * paths are not recorded, as vfs_lookup only asks about single
+ * names.
+ */
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct dcentry *de;
+	unsigned hash, h;
+
+	KASSERT(dir != NULL);
+
+	if (strlen(name) >= DCACHE_NAMELEN || strchr(name, '/') != NULL) {
+		return;
+	}
+	hash = dc_namehash(dir, name);
+
+	spinlock_acquire(&dc_lock);
+
+	de = dc_find(dir, name, hash);
+	if (de != NULL) {
+		dc_remove(de);
+	}
+
+	/* Recycle the least recently used entry */
+	de = dc_lruhead;
+	KASSERT(de != NULL);
+	if (de->de_dir != NULL) {
+		dc_remove(de);
+		dc_stats.evictions++;
+	}
+
+	de->de_dir = dir;
+	strcpy(de->de_name, name);
+	de->de_hash = hash;
+	de->de_vn = vn;
+
+	de->de_namenext = dc_byname[hash % DCACHE_NHASH];
+	dc_byname[hash % DCACHE_NHASH] = de;
+	h = dc_vnhash(dir);
+	de->de_dirnext = dc_bydir[h];
+	dc_bydir[h] = de;
+	if (vn != NULL) {
+		h = dc_vnhash(vn);
+		de->de_vnnext = dc_byvn[h];
+		dc_byvn[h] = de;
+	}
+
+	dc_lru_remove(de);
+	dc_lru_addtail(de);
+	dc_stats.enters++;
+
+	spinlock_release(&dc_lock);
+}
+
+/*
+ * Forget whatever is recorded for NAME in DIR.
+ */
+void
+vfs_dcache_purge(struct vnode *dir, const char *name)
+{
+	struct dcentry *de;
+	unsigned hash;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+	hash = dc_namehash(dir, name);
+
+	spinlock_acquire(&dc_lock);
+	de = dc_find(dir, name, hash);
+	if (de != NULL) {
+		dc_remove(de);
+		dc_stats.purges++;
+	}
+	spinlock_release(&dc_lock);
+}
+
+/*
+ * Forget every entry that names VN or is in directory VN.
+ */
+void
+vfs_dcache_purgevnode(struct vnode *vn)
+{
+	struct dcentry *de, *next;
+	unsigned h;
+
+	h = dc_vnhash(vn);
+
+	spinlock_acquire(&dc_lock);
+	for (de = dc_bydir[h]; de != NULL; de = next) {
+		next = de->de_dirnext;
+		if (de->de_dir == vn) {
+			dc_remove(de);
+			dc_stats.purges++;
+		}
+	}
+	for (de = dc_byvn[h]; de != NULL; de = next) {
+		next = de->de_vnnext;
+		if (de->de_vn == vn) {
+			dc_remove(de);
+			dc_stats.purges++;
+		}
+	}
+	spinlock_release(&dc_lock);
+}
+
+/*
+ * Print the statistics. (Copy them out first; we can't print while
+ * holding a spinlock.)
+ */
+void
+vfs_dcache_printstats(void)
+{
+	unsigned i, inuse, negative, misses;
+	struct dcstats stats;
+
+	inuse = negative = 0;
+	spinlock_acquire(&dc_lock);
+	for (i=0; i<DCACHE_NENTRIES; i++) {
+		if (dc_entries[i].de_dir != NULL) {
+			inuse++;
+			if (dc_entries[i].de_vn == NULL) {
+				negative++;
+			}
+		}
+	}
+	stats = dc_stats;
+	spinlock_release(&dc_lock);
+
+	misses = stats.lookups - stats.hits - stats.neghits;
+
+	kprintf("vfs name cache: %u of %u entries in use, %u negative\n",
+		inuse, DCACHE_NENTRIES, negative);
+	kprintf("%u lookups: %u hits, %u negative hits",
+		stats.lookups, stats.hits, stats.neghits);
+	if (stats.lookups > 0) {
+		kprintf(" (%u%% total)",
+			(stats.hits + stats.neghits) * 100 / stats.lookups);
+	}
+	kprintf(", %u misses\n", misses);
+	kprintf("%u entries made, %u purged, %u evicted\n",
+		stats.enters, stats.purges, stats.evictions);
+}
+
+void
+vfs_dcache_resetstats(void)
+{
+	spinlock_acquire(&dc_lock);
+	bzero(&dc_stats, sizeof(dc_stats));
+	spinlock_release(&dc_lock);
+}
@@ -90,9 +90,12 @@ DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
-/* The big lock for all FS ops. Remove for filesystem assignment. */
-static struct lock *vfs_biglock;
-static unsigned vfs_biglock_depth;
+/*
+ * Lock for the knowndevs table and the kd_fs fields in it. Held
+ * across mount, unmount and sync so a filesystem can't go away under
+ * them; comes before any filesystem's own locks.
+ */
+static struct lock *knowndevs_lock;
 
 
 /*
@@ -106,66 +109,17 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
-	vfs_biglock = lock_create("vfs_biglock");
-	if (vfs_biglock==NULL) {
-		panic("vfs: Could not create vfs big lock\n");
+	knowndevs_lock = lock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
 	}
-	vfs_biglock_depth = 0;
+
+	vfs_dcache_bootstrap();
 
 	devnull_create();
 	semfs_bootstrap();
 }
 
-/*
- * Operations on vfs_biglock. We make it recursive to avoid having to
- * think about where we do and don't already hold it. This is an
- * undesirable hack that's frequently necessary when a lock covers too
- * much material. Your solution scheme for FS and VFS locking should
- * not require recursive locks.
- */
-void
-vfs_biglock_acquire(void)
-{
-	if (!lock_do_i_hold(vfs_biglock)) {
-		lock_acquire(vfs_biglock);
-	}
-	else if (vfs_biglock_depth == 0) {
-		/*
-		 * Supposedly we hold it, but the depth is 0. This may
-		 * mean: (1) the count is messed up, or (2)
-		 * lock_do_i_hold is lying. Since OS/161 ships out of
-		 * the box with unimplemented locks (students
-		 * implement them) that always return true, assume
-		 * situation (2). In this case acquire the lock
-		 * anyway.
-		 *
-		 * Once you have working locks, this won't be the
-		 * case, and if you get here it should be situation
-		 * (1), in which case the count is messed up and one
-		 * can panic.
-		 */
-		lock_acquire(vfs_biglock);
-	}
-	vfs_biglock_depth++;
-}
-
-void
-vfs_biglock_release(void)
-{
-	KASSERT(lock_do_i_hold(vfs_biglock));
-	KASSERT(vfs_biglock_depth > 0);
-	vfs_biglock_depth--;
-	if (vfs_biglock_depth == 0) {
-		lock_release(vfs_biglock);
-	}
-}
-
-bool
-vfs_biglock_do_i_hold(void)
-{
-	return lock_do_i_hold(vfs_biglock);
-}
-
 /*
  * Global sync function - call FSOP_SYNC on all devices.
  */
@@ -175,7 +129,7 @@ vfs_sync(void)
 	struct knowndev *dev;
 	unsigned i, num;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -185,7 +139,7 @@ vfs_sync(void)
 		}
 	}
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 
 	return 0;
 }
@@ -199,8 +153,9 @@ vfs_getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
+	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -221,12 +176,15 @@ vfs_getroot(const char *devname, struct vnode **ret)
 
 			if (!strcmp(kd->kd_name, devname) ||
 			    (volname!=NULL && !strcmp(volname, devname))) {
-				return FSOP_GETROOT(kd->kd_fs, ret);
+				result = FSOP_GETROOT(kd->kd_fs, ret);
+				lock_release(knowndevs_lock);
+				return result;
 			}
 		}
 		else {
 			if (kd->kd_rawname!=NULL &&
 			    !strcmp(kd->kd_name, devname)) {
+				lock_release(knowndevs_lock);
 				return ENXIO;
 			}
 		}
@@ -242,6 +200,7 @@ vfs_getroot(const char *devname, struct vnode **ret)
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*ret = kd->kd_vnode;
+			lock_release(knowndevs_lock);
 			return 0;
 		}
 
@@ -253,6 +212,7 @@ vfs_getroot(const char *devname, struct vnode **ret)
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*ret = kd->kd_vnode;
+			lock_release(knowndevs_lock);
 			return 0;
 		}
 
@@ -267,6 +227,7 @@ vfs_getroot(const char *devname, struct vnode **ret)
 	 * If we got here, the device specified by devname doesn't exist.
 	 */
 
+	lock_release(knowndevs_lock);
 	return ENODEV;
 }
 
@@ -281,7 +242,7 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -294,10 +255,12 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
+			lock_release(knowndevs_lock);
 			return kd->kd_name;
 		}
 	}
 
+	lock_release(knowndevs_lock);
 	return NULL;
 }
 
@@ -358,7 +321,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -401,7 +364,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	/* Silence warning with gcc 4.8 -Og (but not -O2) */
 	index = 0;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -453,7 +416,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return 0;
 
  fail:
@@ -470,7 +433,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return result;
 }
 
@@ -509,7 +472,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -543,16 +506,16 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -560,7 +523,7 @@ vfs_mount(const char *devname, void *data,
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
 		return result;
 	}
 
@@ -573,7 +536,7 @@ vfs_mount(const char *devname, void *data,
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return 0;
 }
 
@@ -601,7 +564,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		devname = myname;
 	}
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -622,7 +585,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	*ret = kd->kd_vnode;
 
  out:
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	if (myname != NULL) {
 		kfree(myname);
 	}
@@ -640,7 +603,7 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -673,7 +636,7 @@ vfs_unmount(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return result;
 }
 
@@ -690,7 +653,7 @@ vfs_swapoff(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -710,7 +673,7 @@ vfs_swapoff(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return result;
 }
 
@@ -724,7 +687,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -780,7 +743,7 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 
 	return 0;
 }
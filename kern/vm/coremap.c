@@ -0,0 +1,603 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+
+/*
+ * Coremap: the physical page allocator.
+ *
+ * There is one entry for every frame of RAM. Frames below the first
+ * free address handed over by ram_getfirstfree (the kernel image,
+ * anything stolen during boot, and the coremap itself) are fixed and
+ * never change. The rest are managed by a binary buddy allocator.
+ *
+ * Free memory is kept as blocks of 2^k frames, each aligned to its
+ * own size, on one doubly linked free list per order k. An allocation
+ * of n frames takes the smallest block of at least n frames, splitting
+ * larger blocks in half as needed, and gives back the unused tail. A
+ * freed block is merged with its buddy (the other half of the block
+ * of twice the size) for as long as the buddy is free too. Both take
+ * O(log n) steps.
+ *
+ * Only the first frame of a free block is marked with its state and
+ * order; the state of the other frames in it is left stale. This is
+ * safe because if a block's buddy is free, the buddy's first frame
+ * is always the first frame of a free block. The first frame of each
+ * allocation records its length, which is how coremap_free knows how
+ * much to give back.
+ *
+ * The first frame of each allocation also carries a reference count,
+ * so user pages can be shared copy-on-write between address spaces.
+ * coremap_alloc hands out one reference, coremap_share adds one, and
+ * coremap_free drops one and frees the allocation when none are left.
+ *
+ * User pages that may be paged out are given an owner, the address
+ * space and virtual address that map them. coremap_victim picks one
+ * to evict with the clock (second chance) algorithm: a hand sweeps
+ * over the frames, clearing the reference bit of each owned page,
+ * and stops at the first one whose bit was already clear. There is
+ * no hardware reference bit, so the VM system sets it with
+ * coremap_touch whenever it loads the page into the TLB; since the
+ * TLB is flushed on every context switch, that happens often enough
+ * to tell recently used pages from the rest.
+ *
+ * Pages shared by more than one address space have no single owner
+ * to evict them from, and are skipped.
+ */
+
+#define CME_FREE	0	/* first frame of a free block */
+#define CME_USED	1	/* allocated */
+#define CME_FIXED	2	/* kernel, or taken before bootstrap */
+
+#define CM_NORDERS	11		/* blocks of up to 2^10 frames */
+#define CM_NOFRAME	((uint32_t)-1)	/* end of free list */
+
+struct cmentry {
+	uint32_t cme_prev;		/* free list links (frame numbers) */
+	uint32_t cme_next;
+	uint32_t cme_npages;		/* length, on the first frame of a run */
+	unsigned cme_state;		/* CME_* */
+	unsigned cme_order;		/* order, on the first frame of a block */
+	unsigned cme_refcount;		/* references, on the first frame */
+	struct addrspace *cme_as;	/* owner, if pageable */
+	vaddr_t cme_vaddr;		/* where the owner maps it */
+	bool cme_referenced;		/* used since the hand last passed */
+	void *cme_kheap;		/* kmalloc's record for a heap page */
+};
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct cmentry *coremap;		/* NULL until coremap_bootstrap */
+static unsigned cm_nframes;		/* frames of RAM */
+static unsigned cm_firstframe;		/* first frame we manage */
+static uint32_t cm_freelist[CM_NORDERS];	/* free blocks by order */
+static unsigned cm_nblocks[CM_NORDERS];	/* length of each free list */
+static unsigned cm_nfree;		/* free frames */
+static unsigned cm_nused;		/* frames allocated */
+static uint32_t cm_hand;		/* clock hand */
+
+/*
+ * Free list handling.
+ */
+
+static
+void
+cm_freelist_add(uint32_t frame, unsigned order)
+{
+	struct cmentry *cme = &coremap[frame];
+
+	cme->cme_state = CME_FREE;
+	cme->cme_order = order;
+	cme->cme_npages = 0;
+	cme->cme_prev = CM_NOFRAME;
+	cme->cme_next = cm_freelist[order];
+	if (cm_freelist[order] != CM_NOFRAME) {
+		coremap[cm_freelist[order]].cme_prev = frame;
+	}
+	cm_freelist[order] = frame;
+	cm_nblocks[order]++;
+}
+
+static
+void
+cm_freelist_remove(uint32_t frame, unsigned order)
+{
+	struct cmentry *cme = &coremap[frame];
+
+	KASSERT(cme->cme_state == CME_FREE);
+	KASSERT(cme->cme_order == order);
+	if (cme->cme_prev != CM_NOFRAME) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		KASSERT(cm_freelist[order] == frame);
+		cm_freelist[order] = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NOFRAME) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	/* No longer the start of a free block of this order. */
+	cme->cme_state = CME_USED;
+	cme->cme_order = CM_NORDERS;
+	cm_nblocks[order]--;
+}
+
+/*
+ * Free the block of 2^ORDER frames at FRAME, merging it with its
+ * buddy as far as possible.
+ */
+static
+void
+cm_freeblock(uint32_t frame, unsigned order)
+{
+	uint32_t buddy;
+
+	KASSERT(frame % (1U << order) == 0);
+
+	while (order < CM_NORDERS - 1) {
+		buddy = frame ^ (1U << order);
+		if (buddy < cm_firstframe ||
+		    buddy + (1U << order) > cm_nframes ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		cm_freelist_remove(buddy, order);
+		if (buddy < frame) {
+			coremap[frame].cme_order = CM_NORDERS;
+			frame = buddy;
+		}
+		order++;
+	}
+	cm_freelist_add(frame, order);
+}
+
+/*
+ * Free the frames from START up to END, which need not be a power of
+ * two in size, as the largest aligned blocks that fit.
+ */
+static
+void
+cm_freerange(uint32_t start, uint32_t end)
+{
+	unsigned order;
+
+	while (start < end) {
+		order = 0;
+		while (order < CM_NORDERS - 1 &&
+		       start % (2U << order) == 0 &&
+		       start + (2U << order) <= end) {
+			order++;
+		}
+		cm_freeblock(start, order);
+		start += 1U << order;
+	}
+}
+
+/*
+ * Take over physical memory. Called from vm_bootstrap, before the
+ * other cpus are started.
+ */
+void
+coremap_bootstrap(void)
+{
+	struct cmentry *map;
+	paddr_t pa;
+	unsigned nframes, firstframe, mappages, i;
+	uint32_t frame;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap == NULL);
+
+	nframes = ram_getsize() / PAGE_SIZE;
+	mappages = DIVROUNDUP(nframes * sizeof(struct cmentry), PAGE_SIZE);
+	pa = ram_stealmem(mappages);
+	if (pa == 0) {
+		panic("coremap: no memory for %u frames\n", nframes);
+	}
+	map = (struct cmentry *)PADDR_TO_KVADDR(pa);
+	firstframe = ram_getfirstfree() / PAGE_SIZE;
+
+	coremap = map;
+	cm_nframes = nframes;
+	cm_firstframe = firstframe;
+	for (i=0; i<CM_NORDERS; i++) {
+		cm_freelist[i] = CM_NOFRAME;
+		cm_nblocks[i] = 0;
+	}
+
+	for (frame = 0; frame < nframes; frame++) {
+		map[frame].cme_prev = map[frame].cme_next = CM_NOFRAME;
+		map[frame].cme_npages = 0;
+		map[frame].cme_state = frame < firstframe ? CME_FIXED : CME_USED;
+		map[frame].cme_order = CM_NORDERS;
+		map[frame].cme_refcount = 0;
+		map[frame].cme_as = NULL;
+		map[frame].cme_vaddr = 0;
+		map[frame].cme_referenced = false;
+		map[frame].cme_kheap = NULL;
+	}
+	cm_hand = firstframe;
+	cm_freerange(firstframe, nframes);
+	cm_nfree = nframes - firstframe;
+	cm_nused = 0;
+
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u frames, %u free\n", nframes, nframes - firstframe);
+}
+
+/*
+ * Allocate NPAGES contiguous frames.
+ */
+paddr_t
+coremap_alloc(unsigned npages)
+{
+	paddr_t pa;
+	uint32_t first, frame;
+	unsigned want, order;
+
+	KASSERT(npages > 0);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (coremap == NULL) {
+		/* Early in boot; this memory is gone for good. */
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	/* Smallest order that will hold it... */
+	want = 0;
+	while (want < CM_NORDERS && (1U << want) < npages) {
+		want++;
+	}
+	/* ...and the smallest free block at least that big. */
+	for (order = want; order < CM_NORDERS; order++) {
+		if (cm_freelist[order] != CM_NOFRAME) {
+			break;
+		}
+	}
+	if (order >= CM_NORDERS) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	first = cm_freelist[order];
+	cm_freelist_remove(first, order);
+
+	/* Split it down, freeing the upper halves. */
+	while (order > want) {
+		order--;
+		cm_freelist_add(first + (1U << order), order);
+	}
+
+	/* Give back whatever is past the end of the request. */
+	cm_freerange(first + npages, first + (1U << want));
+
+	for (frame = first; frame < first + npages; frame++) {
+		coremap[frame].cme_state = CME_USED;
+		coremap[frame].cme_npages = 0;
+	}
+	coremap[first].cme_npages = npages;
+	coremap[first].cme_refcount = 1;
+	cm_nfree -= npages;
+	cm_nused += npages;
+
+	spinlock_release(&coremap_lock);
+	return (paddr_t)first * PAGE_SIZE;
+}
+
+/*
+ * Find the coremap entry for the allocation starting at PA, or NULL
+ * if it was stolen during boot. Call with the coremap lock held.
+ */
+static
+struct cmentry *
+cm_getalloc(paddr_t pa)
+{
+	uint32_t first;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	first = pa / PAGE_SIZE;
+
+	if (coremap == NULL || first < cm_firstframe) {
+		return NULL;
+	}
+
+	KASSERT(first < cm_nframes);
+	if (coremap[first].cme_state != CME_USED ||
+	    coremap[first].cme_npages == 0) {
+		panic("coremap: 0x%lx is not an allocation\n",
+		      (unsigned long)pa);
+	}
+	KASSERT(coremap[first].cme_refcount > 0);
+	KASSERT(first + coremap[first].cme_npages <= cm_nframes);
+	return &coremap[first];
+}
+
+/*
+ * Drop a reference to the allocation starting at PA, and free it if
+ * that was the last one. Returns true if it was freed.
+ */
+bool
+coremap_free(paddr_t pa)
+{
+	struct cmentry *cme;
+	uint32_t first;
+	unsigned npages;
+
+	spinlock_acquire(&coremap_lock);
+
+	cme = cm_getalloc(pa);
+	if (cme == NULL) {
+		/* Stolen during boot; we can't take it back. */
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	if (--cme->cme_refcount > 0) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+
+	first = pa / PAGE_SIZE;
+	npages = cme->cme_npages;
+	cme->cme_npages = 0;
+	cme->cme_as = NULL;
+	cm_freerange(first, first + npages);
+	cm_nfree += npages;
+	cm_nused -= npages;
+
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+/*
+ * Add a reference to the allocation starting at PA.
+ */
+void
+coremap_share(paddr_t pa)
+{
+	struct cmentry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = cm_getalloc(pa);
+	KASSERT(cme != NULL);
+	cme->cme_refcount++;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Return the number of references to the allocation starting at PA.
+ */
+unsigned
+coremap_refcount(paddr_t pa)
+{
+	struct cmentry *cme;
+	unsigned ret;
+
+	spinlock_acquire(&coremap_lock);
+	cme = cm_getalloc(pa);
+	ret = cme == NULL ? 1 : cme->cme_refcount;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+/*
+ * Make the page at PA pageable, owned by AS at VADDR, or if AS is
+ * NULL, not pageable.
+ */
+void
+coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	struct cmentry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = cm_getalloc(pa);
+	KASSERT(cme != NULL);
+	KASSERT(cme->cme_npages == 1);
+	cme->cme_as = as;
+	cme->cme_vaddr = vaddr;
+	cme->cme_referenced = true;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Make the page at PA not pageable if AS owns it.
+ */
+void
+coremap_disown(paddr_t pa, struct addrspace *as)
+{
+	struct cmentry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = cm_getalloc(pa);
+	if (cme != NULL && cme->cme_as == as) {
+		cme->cme_as = NULL;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Note that the page at PA has been used. This is on the TLB refill
+ * path, so it doesn't lock: a lost update only costs a second chance.
+ */
+void
+coremap_touch(paddr_t pa)
+{
+	uint32_t frame = pa / PAGE_SIZE;
+
+	if (coremap != NULL && frame >= cm_firstframe && frame < cm_nframes) {
+		coremap[frame].cme_referenced = true;
+	}
+}
+
+/*
+ * Set or get the kernel heap's record for the page at PA. These
+ * don't lock: only kmalloc uses them, under its own lock or for
+ * pages it knows it has allocated. Pages taken before the coremap
+ * was set up have no record.
+ */
+void
+coremap_setkheap(paddr_t pa, void *data)
+{
+	uint32_t frame = pa / PAGE_SIZE;
+
+	if (coremap != NULL) {
+		KASSERT(frame < cm_nframes);
+		coremap[frame].cme_kheap = data;
+	}
+}
+
+void *
+coremap_getkheap(paddr_t pa)
+{
+	uint32_t frame = pa / PAGE_SIZE;
+
+	if (coremap == NULL || frame >= cm_nframes) {
+		return NULL;
+	}
+	return coremap[frame].cme_kheap;
+}
+
+/*
+ * Choose a page to evict. On success, the page stops being pageable
+ * (so nobody else picks it too) and its frame and owner are returned.
+ * Returns false if there are no pageable pages.
+ */
+bool
+coremap_victim(paddr_t *pa, struct addrspace **as, vaddr_t *vaddr)
+{
+	struct cmentry *cme;
+	unsigned n;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap == NULL) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+
+	/* Two sweeps: the first may only clear reference bits. */
+	for (n = 0; n < 2 * (cm_nframes - cm_firstframe); n++) {
+		cme = &coremap[cm_hand];
+		if (++cm_hand >= cm_nframes) {
+			cm_hand = cm_firstframe;
+		}
+
+		if (cme->cme_state != CME_USED || cme->cme_npages != 1 ||
+		    cme->cme_as == NULL || cme->cme_refcount != 1) {
+			continue;
+		}
+		if (cme->cme_referenced) {
+			cme->cme_referenced = false;
+			continue;
+		}
+
+		*pa = (paddr_t)(cme - coremap) * PAGE_SIZE;
+		*as = cme->cme_as;
+		*vaddr = cme->cme_vaddr;
+		cme->cme_as = NULL;
+		spinlock_release(&coremap_lock);
+		return true;
+	}
+
+	spinlock_release(&coremap_lock);
+	return false;
+}
+
+/*
+ * Return the number of free frames.
+ */
+unsigned
+coremap_nfree(void)
+{
+	return cm_nfree;
+}
+
+/*
+ * Print the state of physical memory, including how fragmented the
+ * free part of it is: the free blocks of each size, and how much of
+ * the free memory is in blocks smaller than the biggest block the
+ * managed memory could hold (2^10 frames on any sizeable machine).
+ */
+void
+coremap_printstats(void)
+{
+	unsigned nblocks[CM_NORDERS];
+	unsigned nframes, nfixed, nfree, nused, largest, top, small, i;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap == NULL) {
+		spinlock_release(&coremap_lock);
+		kprintf("coremap: not initialized\n");
+		return;
+	}
+	nframes = cm_nframes;
+	nfixed = cm_firstframe;
+	nfree = cm_nfree;
+	nused = cm_nused;
+	for (i=0; i<CM_NORDERS; i++) {
+		nblocks[i] = cm_nblocks[i];
+	}
+	spinlock_release(&coremap_lock);
+
+	largest = 0;
+	for (i=0; i<CM_NORDERS; i++) {
+		if (nblocks[i] > 0) {
+			largest = 1U << i;
+		}
+	}
+
+	/* Free memory in blocks below the biggest that fits. */
+	top = 0;
+	while (top < CM_NORDERS - 1 && (2U << top) <= nframes - nfixed) {
+		top++;
+	}
+	small = 0;
+	for (i=0; i<top; i++) {
+		small += nblocks[i] << i;
+	}
+
+	kprintf("Physical memory: %u frames (%uk)\n",
+		nframes, nframes * PAGE_SIZE / 1024);
+	kprintf("   %u fixed, %u used, %u free; largest free block %u\n",
+		nfixed, nused, nfree, largest);
+	kprintf("   free blocks by size (pages):");
+	for (i=0; i<CM_NORDERS; i++) {
+		kprintf(" %u:%u", 1U << i, nblocks[i]);
+	}
+	kprintf("\n");
+	kprintf("   fragmentation: %u%% of free memory is in blocks "
+		"smaller than %u pages\n",
+		nfree == 0 ? 0 : small * 100 / nfree, 1U << top);
+}
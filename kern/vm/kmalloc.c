@@ -29,8 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <coremap.h>
 
 /*
  * Kernel malloc.
@@ -812,6 +816,9 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_cache_printstats();
+	coremap_printstats();
 }
 
 ////////////////////////////////////////
@@ -866,6 +873,44 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take one block off the free list of page PR, which must have one.
+ */
+static
+void *
+subpage_take(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -921,25 +966,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_take(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -1013,10 +1040,117 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	/* Let kfree find it directly */
+	coremap_setkheap(prpage - MIPS_KSEG0, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Find the heap page that block address PTRADDR is on, and return its
+ * pageref, page address, and block type. Returns NULL if it is not on
+ * any of our pages.
+ */
+static
+struct pageref *
+subpage_lookup(vaddr_t ptraddr, vaddr_t *prpage_ret, int *blktype_ret)
+{
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	int blktype;		// index into sizes[] that we're using
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	/* Pages we made since the coremap was set up are recorded there */
+	pr = coremap_getkheap(ptraddr - MIPS_KSEG0);
+	if (pr != NULL) {
+		KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+		checksubpage(pr);
+		*prpage_ret = PR_PAGEADDR(pr);
+		*blktype_ret = PR_BLOCKTYPE(pr);
+		return pr;
+	}
+
+	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
+	prpage = 0;
+	blktype = 0;
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+		KASSERT(blktype >= 0 && blktype < NSIZES);
+
+		/* check for corruption */
+		KASSERT(blktype>=0 && blktype<NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			break;
+		}
+	}
+
+	*prpage_ret = prpage;
+	*blktype_ret = blktype;
+	return pr;
+}
+
+/*
+ * Put the block at OFFSET on page PR back on the page's free list.
+ * If that leaves the whole page free, take the page off the heap and
+ * return true; the caller must then free_kpages it once it has
+ * released kmalloc_spinlock.
+ */
+static
+bool
+subpage_release(struct pageref *pr, vaddr_t prpage, vaddr_t offset,
+		int blktype)
+{
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		coremap_setkheap(prpage - MIPS_KSEG0, NULL);
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		return true;
+	}
+	return false;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1029,8 +1163,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1065,24 +1197,7 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_lookup(ptraddr, &prpage, &blktype);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
@@ -1108,40 +1223,7 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (subpage_release(pr, prpage, offset, blktype)) {
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1159,6 +1241,252 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Every trip into the subpage allocator takes kmalloc_spinlock, which
+// makes it a bottleneck as soon as several cpus allocate at once. So
+// in front of it each cpu keeps, for each block size, a magazine: a
+// small stack of free blocks it can hand out without touching the
+// global lock. An empty magazine is refilled with a batch of blocks
+// in one trip to the pools.
+//
+// Frees go the other way. kfree finds the block's heap page (and so
+// its size) through the page's coremap record, without any lock, and
+// fills the block with 0xdeadbeef right away. The block is then
+// collected, with its page, in a per-cpu list, and the list is
+// sorted out in one batch: each block goes back into this cpu's
+// magazine for its size if there is room, and otherwise back to its
+// page. The page can't go away meanwhile, since the block still
+// counts as allocated on it.
+//
+// A cpu's magazines are only ever touched by that cpu with interrupts
+// off, so they need no lock. Blocks sitting in magazines still count
+// as allocated as far as their pages are concerned, which means
+// kheap_printstats shows them as in use and their pages are not
+// returned until they drain.
+//
+// The debugging modes that decorate each block (GUARDS and LABELS)
+// need every allocation to go through subpage_kmalloc, so magazines
+// are disabled with those.
+//
+
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
+#ifdef MAGAZINES
+
+#define MAG_MAXCPUS	32	/* further cpus use the pools directly */
+#define MAG_ROUNDS	16	/* blocks held per size */
+#define MAG_FREES	16	/* frees collected before sorting */
+
+struct kmagazine {
+	void *km_rounds[NSIZES][MAG_ROUNDS];
+	unsigned km_nrounds[NSIZES];
+	void *km_frees[MAG_FREES];
+	struct pageref *km_freepages[MAG_FREES];	/* page of each */
+	unsigned km_nfrees;
+};
+
+static struct kmagazine kmagazines[MAG_MAXCPUS];
+static volatile bool kmagazines_on = true;
+
+/*
+ * Get the current cpu's magazines, or NULL if it can't have any. Call
+ * with interrupts off.
+ */
+static
+struct kmagazine *
+mag_get(void)
+{
+	if (!kmagazines_on || !CURCPU_EXISTS() || curcpu == NULL ||
+	    curcpu->c_number >= MAG_MAXCPUS) {
+		return NULL;
+	}
+	return &kmagazines[curcpu->c_number];
+}
+
+/*
+ * Fill half of an empty magazine from the pages of its size, so there
+ * is room left for frees to come back to it.
+ */
+static
+void
+mag_refill(struct kmagazine *km, unsigned blktype)
+{
+	struct pageref *pr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+
+	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		while (pr->nfree > 0 &&
+		       km->km_nrounds[blktype] < MAG_ROUNDS / 2) {
+			km->km_rounds[blktype][km->km_nrounds[blktype]++] =
+				subpage_take(pr);
+		}
+		if (km->km_nrounds[blktype] == MAG_ROUNDS / 2) {
+			break;
+		}
+	}
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Sort out the collected frees: into the magazines if there's room,
+ * otherwise back onto their pages.
+ */
+static
+void
+mag_flush(struct kmagazine *km)
+{
+	vaddr_t freepages[MAG_FREES];
+	unsigned nfreepages, i;
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage, offset;
+	int blktype;
+
+	nfreepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+
+	for (i=0; i<km->km_nfrees; i++) {
+		ptraddr = (vaddr_t)km->km_frees[i];
+		pr = km->km_freepages[i];
+		checksubpage(pr);
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+		offset = ptraddr - prpage;
+
+		if (km->km_nrounds[blktype] < MAG_ROUNDS) {
+			km->km_rounds[blktype][km->km_nrounds[blktype]++] =
+				km->km_frees[i];
+		}
+		else if (subpage_release(pr, prpage, offset, blktype)) {
+			freepages[nfreepages++] = prpage;
+		}
+	}
+	km->km_nfrees = 0;
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Allocate a block of type BLKTYPE from this cpu's magazine. Returns
+ * NULL if there isn't one to be had without making a new heap page;
+ * the caller then goes to subpage_kmalloc.
+ */
+static
+void *
+mag_alloc(unsigned blktype)
+{
+	struct kmagazine *km;
+	void *ret;
+	int spl;
+
+	ret = NULL;
+	spl = splhigh();
+	km = mag_get();
+	if (km != NULL) {
+		if (km->km_nrounds[blktype] == 0) {
+			mag_refill(km, blktype);
+		}
+		if (km->km_nrounds[blktype] > 0) {
+			ret = km->km_rounds[blktype][--km->km_nrounds[blktype]];
+		}
+	}
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Queue PTR to be freed by this cpu's magazines. Returns false if
+ * there are none, in which case the caller frees it directly.
+ *
+ * Page-aligned pointers are not taken; they might be whole-page
+ * allocations, which don't belong here.
+ */
+static
+bool
+mag_free(void *ptr)
+{
+	struct kmagazine *km;
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage, offset;
+	int blktype, spl;
+
+	ptraddr = (vaddr_t)ptr;
+	if (ptraddr % PAGE_SIZE == 0) {
+		return false;
+	}
+
+	/*
+	 * Find its page. We own the block, so the page stays on the
+	 * heap and its record stays put; no lock needed. If there's
+	 * no record, let subpage_kfree sort it out.
+	 */
+	pr = coremap_getkheap(ptraddr - MIPS_KSEG0);
+	if (pr == NULL) {
+		return false;
+	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
+	KASSERT(prpage == (ptraddr & PAGE_FRAME));
+
+	offset = ptraddr - prpage;
+	if (offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/* As in subpage_kfree, catch uses of dangling pointers. */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spl = splhigh();
+	km = mag_get();
+	if (km == NULL) {
+		splx(spl);
+		return false;
+	}
+	km->km_frees[km->km_nfrees] = ptr;
+	km->km_freepages[km->km_nfrees] = pr;
+	km->km_nfrees++;
+	if (km->km_nfrees == MAG_FREES) {
+		mag_flush(km);
+	}
+	splx(spl);
+	return true;
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Turn the magazine layer on or off, for benchmarking. Blocks already
+ * in magazines stay there until it is turned back on.
+ */
+void
+kheap_setmagazines(bool on)
+{
+#ifdef MAGAZINES
+	kmagazines_on = on;
+#else
+	(void)on;
+#endif
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1201,6 +1529,16 @@ kmalloc(size_t sz)
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
+#ifdef MAGAZINES
+	{
+		void *ptr;
+
+		ptr = mag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
 	return subpage_kmalloc(sz);
 #endif
 }
@@ -1216,9 +1554,320 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	else if (mag_free(ptr)) {
+		return;
+	}
+#endif
+	else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
 
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+// A kmem_cache hands out objects of one fixed size. It carves whole
+// pages ("slabs") into slots of exactly that size (plus a link word,
+// rounded up to 8 bytes), so that, say, a 20-byte lock takes 24 bytes
+// instead of the 32 of the next kmalloc size class.
+//
+// If the cache has a constructor, it is run on each object once, when
+// the slab it's on is created, and the destructor once when the slab
+// is given back. In between, objects go back and forth between the
+// cache and its users in constructed state; users must hand them back
+// in the same state they got them. That's why the free list link goes
+// after the object rather than over the start of it.
+//
+// The slab header lives at the end of its page, so freeing an object
+// finds its slab with a mask. Slabs with free slots are kept on a
+// list; full slabs are on no list. Each cache keeps at most one
+// completely free slab and returns any others to the page allocator.
+//
+// Slabs come straight from alloc_kpages rather than from the subpage
+// allocator above: a slab has to be page-aligned for the mask to
+// work, and a whole page wastes less to rounding than a subpage
+// block would.
+//
+
+#define KMEM_ALIGN	8
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;	/* on kc_partial */
+	struct kmem_slab *ks_prev;
+	struct kmem_cache *ks_cache;
+	void *ks_freelist;		/* first free object */
+	unsigned ks_nfree;		/* number of free objects */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size */
+	size_t kc_slotsize;		/* object + link, aligned */
+	unsigned kc_perslab;		/* slots per slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;	/* slabs with free slots */
+	unsigned kc_nempty;		/* completely free slabs */
+
+	/* statistics */
+	unsigned kc_nslabs;		/* slabs in existence */
+	unsigned kc_inuse;		/* objects handed out */
+	unsigned long kc_allocs;	/* total kmem_cache_alloc calls */
+	unsigned long kc_ctors;		/* total constructor calls */
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+};
+
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+/* The free list link of an object sits just after the object. */
+#define KS_LINK(kc, obj) (*(void **)((char *)(obj) + (kc)->kc_slotsize - sizeof(void *)))
+#define KS_SLAB(obj) \
+	((struct kmem_slab *)(((vaddr_t)(obj) & PAGE_FRAME) + \
+			      PAGE_SIZE - sizeof(struct kmem_slab)))
+
+/*
+ * Create an object cache for objects of SIZE bytes. CTOR (which
+ * returns an error code) and DTOR may be NULL. NAME should be a
+ * string constant.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	size_t slotsize;
+
+	slotsize = ROUNDUP(size + sizeof(void *), KMEM_ALIGN);
+	if (slotsize > (PAGE_SIZE - sizeof(struct kmem_slab)) / 4) {
+		/* Too few to a page to be worth it. */
+		panic("kmem_cache_create: %s: objects of size %zu too large\n",
+		      name, size);
+	}
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_slotsize = slotsize;
+	kc->kc_perslab = (PAGE_SIZE - sizeof(struct kmem_slab)) / slotsize;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_nempty = 0;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_ctors = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+/*
+ * Make a new slab for KC and construct its objects. Called without
+ * kc_lock, since getting a page and running constructors may sleep.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	char *obj;
+	unsigned i, j;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	ks = KS_SLAB(page);
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_cache = kc;
+	ks->ks_freelist = NULL;
+	ks->ks_nfree = kc->kc_perslab;
+
+	/* Build the free list backwards, so it runs in address order. */
+	for (i = kc->kc_perslab; i-- > 0; ) {
+		obj = (char *)page + i * kc->kc_slotsize;
+		if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0) {
+			/* Undo the ones already done, and give up. */
+			for (j = i + 1;
+			     kc->kc_dtor != NULL && j < kc->kc_perslab; j++) {
+				kc->kc_dtor((char *)page + j * kc->kc_slotsize);
+			}
+			free_kpages(page);
+			return NULL;
+		}
+		KS_LINK(kc, obj) = ks->ks_freelist;
+		ks->ks_freelist = obj;
+	}
+	return ks;
+}
+
+/*
+ * Destroy a completely free slab. Called without kc_lock.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	vaddr_t page;
+	unsigned i;
+
+	KASSERT(ks->ks_nfree == kc->kc_perslab);
+	page = (vaddr_t)ks & PAGE_FRAME;
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			kc->kc_dtor((char *)page + i * kc->kc_slotsize);
+		}
+	}
+	free_kpages(page);
+}
+
+static
+void
+kmem_partial_add(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = kc->kc_partial;
+	if (kc->kc_partial != NULL) {
+		kc->kc_partial->ks_prev = ks;
+	}
+	kc->kc_partial = ks;
+}
+
+static
+void
+kmem_partial_remove(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(kc->kc_partial == ks);
+		kc->kc_partial = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Get a (constructed) object from KC. Returns NULL if out of memory.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL) {
+		spinlock_release(&kc->kc_lock);
+		ks = kmem_slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kmem_partial_add(kc, ks);
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctors += kc->kc_perslab;
+		}
+	}
+
+	ks = kc->kc_partial;
+	KASSERT(ks->ks_nfree > 0);
+	if (ks->ks_nfree == kc->kc_perslab) {
+		kc->kc_nempty--;
+	}
+	obj = ks->ks_freelist;
+	ks->ks_freelist = KS_LINK(kc, obj);
+	ks->ks_nfree--;
+	if (ks->ks_nfree == 0) {
+		kmem_partial_remove(kc, ks);
+	}
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+/*
+ * Return OBJ, in constructed state, to KC.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks;
+
+	KASSERT(obj != NULL);
+	ks = KS_SLAB(obj);
+	KASSERT(ks->ks_cache == kc);
+	KASSERT(((vaddr_t)obj & ~(vaddr_t)PAGE_FRAME) % kc->kc_slotsize == 0);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(ks->ks_nfree < kc->kc_perslab);
+	if (ks->ks_nfree == 0) {
+		kmem_partial_add(kc, ks);
+	}
+	KS_LINK(kc, obj) = ks->ks_freelist;
+	ks->ks_freelist = obj;
+	ks->ks_nfree++;
+	kc->kc_inuse--;
+
+	if (ks->ks_nfree == kc->kc_perslab) {
+		if (kc->kc_nempty > 0) {
+			/* Already have a spare; give this one back. */
+			kmem_partial_remove(kc, ks);
+			kc->kc_nslabs--;
+			spinlock_release(&kc->kc_lock);
+			kmem_slab_destroy(kc, ks);
+			return;
+		}
+		kc->kc_nempty++;
+	}
+	spinlock_release(&kc->kc_lock);
+}
+
+/*
+ * Print statistics for every object cache.
+ */
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("   %-12s size %3zu/%-3zu  %u slabs, %u/%u in use, "
+			"%lu allocs, %lu ctors\n",
+			kc->kc_name, kc->kc_size, kc->kc_slotsize,
+			kc->kc_nslabs, kc->kc_inuse,
+			kc->kc_nslabs * kc->kc_perslab,
+			kc->kc_allocs, kc->kc_ctors);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2017
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * Swap space on a raw disk.
+ *
+ * Slot n is the page at byte offset n * PAGE_SIZE on the disk. Free
+ * slots are found with a bitmap; each slot in use also has a count
+ * of the page tables that refer to it.
+ */
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;	/* NULL if there's no swap */
+static struct bitmap *swap_map;		/* slots in use */
+static uint16_t *swap_refs;		/* references to each slot */
+static unsigned swap_nslots;
+static unsigned swap_nused;
+
+void
+swap_bootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	unsigned nslots;
+	int result;
+
+	/* vfs_open may scribble on the name */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; swapping disabled\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots == 0) {
+		kprintf("swap: %s is too small; swapping disabled\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_map = bitmap_create(nslots);
+	swap_refs = kmalloc(nslots * sizeof(swap_refs[0]));
+	if (swap_map == NULL || swap_refs == NULL) {
+		panic("swap: no memory for %u slots\n", nslots);
+	}
+	bzero(swap_refs, nslots * sizeof(swap_refs[0]));
+	swap_nslots = nslots;
+	swap_nused = 0;
+
+	kprintf("swap: %s, %u pages\n", SWAP_DEVICE, nslots);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+/*
+ * Take a free slot. Returns ENOSPC if swap is full.
+ */
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		KASSERT(swap_refs[*slot] == 0);
+		swap_refs[*slot] = 1;
+		swap_nused++;
+	}
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void
+swap_share(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_release(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	if (--swap_refs[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between slot SLOT and the frame at PA.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t pa, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+int
+swap_in(unsigned slot, paddr_t pa)
+{
+	return swap_io(slot, pa, UIO_READ);
+}
+
+int
+swap_out(paddr_t pa, unsigned slot)
+{
+	return swap_io(slot, pa, UIO_WRITE);
+}
+
+void
+swap_printstats(void)
+{
+	if (swap_vnode == NULL) {
+		kprintf("swap: disabled\n");
+		return;
+	}
+	kprintf("swap: %u of %u pages in use\n", swap_nused, swap_nslots);
+}